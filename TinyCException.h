@@ -5,6 +5,9 @@
 #include <stdio.h>
 #include <threads.h>
 #include <stdlib.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <ctype.h>
 
 /*
 * TinyCException - A modern, header-only, thread-safe exception handling library for C11.
@@ -34,19 +37,49 @@
 *   - 'CatchAll', 'Finally', and 'CatchCustom' are optional.
 *   - The exception code 'e' must be a non-zero integer.
 *   - Do not use 'goto' to jump across scopes within an exception block.
-*   - Use 'volatile' for local variables modified in 'Try' if they are accessed in 'Catch'.
+*   - Use 'volatile' for local variables modified in 'Try' if they are accessed in 'Catch',
+*     or move the body into a function with 'TryFn'.
 *   - The 'Return', 'Break', and 'Continue' macros bypass the 'Finally' block for performance.
 *     Manual resource cleanup is required before using them.
 *   - The error_code is stored on the stack frame rather than a global thread_local variable
 *     to improve performance, safety, and readability.
 */
 
+// The request-scoped context of a thread: which request and tenant the current work belongs to.
+// It's stamped on every throw, so reports and stats can tell who caused an exception.
+typedef struct tce_scope_t{
+    unsigned long long request_id;
+    unsigned long long tenant_id;
+} tce_scope;
+
+// The details of a throw.
+typedef struct __exp_detail_t{
+    const char* file;
+    const char* func;
+    int line;
+    tce_scope scope;             // The request and tenant the exception was thrown for.
+    void* payload;               // The payload passed to ThrowWith, or NULL.
+    int cause;                   // The code being handled when this one was thrown, or 0.
+} __exp_detail;
+
 // The exception frame structure.
 // It's a linked list node, forming a stack of exception contexts for each thread.
 typedef struct __exp_frame_t{
-    short flag;                  // Flag to ensure 'Finally' block executes only once.
+    short flag;                  // Throw count (bits 0-1), 'Finally' ran (4), end hook runs before 'Finally' (0x100),
+                                 // leaving early (0x200), saved with __builtin_setjmp (0x400).
     int error_code;              // Stores the exception code if one is thrown.
     struct __exp_frame_t* prev;  // Pointer to the previous (outer) exception frame.
+    void (*end_hook)(struct __exp_frame_t*);  // Optional hook run by 'End' before the frame is popped.
+    void* end_arg;               // Argument for the end hook.
+    int handled_code;            // The exception a Catch arm of this frame is handling.
+    int handled_level;           // Its slot in the thread's handled details, 0 for the outermost arm.
+    struct __exp_frame_t* handling_prev;  // The frame that was handling an exception before this one.
+#ifdef TCE_PROFILE_ARMS
+    int arm;                     // Catch arms tested so far for the current exception.
+#endif
+#ifdef TCE_LEAK_CHECK
+    unsigned long long leak_mark;  // The thread's allocation count when the Try was entered.
+#endif
     jmp_buf buf;                 // The buffer to store the execution context for longjmp.
 } __exp_frame;
 
@@ -54,17 +87,975 @@ typedef struct __exp_frame_t{
 // This is the key to making the library thread-safe.
 thread_local static __exp_frame* __exp_stack_top = NULL;
 
-// A thread-local struct to store details (file, function, line) for uncaught exceptions.
-thread_local static struct{
+/*
+* Frame array (define TCE_FRAME_ARRAY before including this header).
+*
+*   Every thread also records its frames in a contiguous array of descriptors, outermost first,
+*   with the site of each Try. The depth is an index, so tce_depth() and tce_frame_at() are O(1)
+*   for samplers and dumps. Frames nested deeper than TCE_MAX_FRAMES still work, but are not
+*   recorded. The array is allocated on the thread's first Try.
+*
+*   With TCE_WATCHDOG (which implies TCE_FRAME_ARRAY, see TinyCException_Watchdog.h), every
+*   descriptor also gets the time its Try was entered, and every thread's array is published
+*   in a registry that a watchdog thread scans without locks.
+*/
+
+#if defined(TCE_WATCHDOG) && !defined(TCE_FRAME_ARRAY)
+#define TCE_FRAME_ARRAY
+#endif
+
+// The descriptor of an active Try.
+typedef struct tce_frame_desc_t{
+    __exp_frame* frame;
     const char* file;
     const char* func;
     int line;
-} __exception_detail_s = {0,0,0};
+#ifdef TCE_WATCHDOG
+    atomic_llong entered;        // When the Try was entered, in ns. Written last, so it also versions the descriptor.
+    atomic_int limit_ms;         // The threshold of the site, or 0 for the watchdog's default.
+    atomic_llong reported;       // The 'entered' of the last overrun the watchdog reported.
+#endif
+} tce_frame_desc;
+
+#ifdef TCE_FRAME_ARRAY
+
+#ifndef TCE_MAX_FRAMES
+#define TCE_MAX_FRAMES 256
+#endif
+
+// The array is allocated on a thread's first Try and freed when the thread exits,
+// so threads that never enter a Try cost only a pointer.
+thread_local static tce_frame_desc* __exp_frames = NULL;
+thread_local static int __exp_depth = 0;
+static tss_t __exp_frames_key;
+static once_flag __exp_frames_once = ONCE_FLAG_INIT;
+
+#ifdef TCE_WATCHDOG
+// The frames of a thread, as seen by the watchdog. Records are reused by later threads, never freed.
+typedef struct __tce_watch_thread_t{
+    tce_frame_desc* frames;
+    atomic_int depth;
+    atomic_int alive;
+    atomic_int signalling;       // Set while the watchdog signals the thread: its exit waits for it.
+    thrd_t thread;
+    int id;                      // A number for reports, unique per record.
+    atomic_llong cancelled;      // The 'entered' of the frame the watchdog cancelled, or 0.
+    struct __tce_watch_thread_t* next;
+} __tce_watch_thread;
+
+static _Atomic(__tce_watch_thread*) __tce_watch_threads = NULL;
+static atomic_int __tce_watch_ids = 0;
+thread_local static __tce_watch_thread* __tce_watch_self = NULL;
+
+// A monotonic clock: a step of the wall clock must not make frames look overdue.
+static inline long long __tce_watch_now(void){
+    struct timespec now;
+#ifdef CLOCK_MONOTONIC
+    clock_gettime(CLOCK_MONOTONIC,&now);
+#else
+    timespec_get(&now,TIME_UTC);    // Without POSIX, C11 has no other clock with this precision.
+#endif
+    return (long long)now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+// Returns the record of an exited thread to the pool.
+static inline void __tce_watch_leave(void* record){
+    __tce_watch_thread* t = (__tce_watch_thread*)record;
+    atomic_store_explicit(&t->depth,0,memory_order_release);
+    // Sequentially consistent, as is the watchdog's 'signalling' store: either the watchdog
+    // sees the thread dead, or the thread sees it signalling and waits until it's done.
+    atomic_store(&t->alive,0);
+    while (atomic_load(&t->signalling)) thrd_yield();
+}
+
+static inline void __exp_frames_key_create(void){
+    if (tss_create(&__exp_frames_key,__tce_watch_leave) != thrd_success) abort();
+}
+
+static inline void __exp_frames_alloc(void){
+    __tce_watch_thread* t;
+    call_once(&__exp_frames_once,__exp_frames_key_create);
+    for (t = atomic_load(&__tce_watch_threads); t; t = t->next){
+        int dead = 0;
+        if (atomic_compare_exchange_strong(&t->alive,&dead,1)) break;
+    }
+    if (!t){
+        t = (__tce_watch_thread*)calloc(1,sizeof(__tce_watch_thread));
+        if (!t || !(t->frames = (tce_frame_desc*)calloc(TCE_MAX_FRAMES,sizeof(tce_frame_desc)))) abort();
+        t->id = atomic_fetch_add(&__tce_watch_ids,1) + 1;
+        atomic_init(&t->alive,1);
+        t->next = atomic_load(&__tce_watch_threads);
+        while (!atomic_compare_exchange_weak(&__tce_watch_threads,&t->next,t));
+    }
+    t->thread = thrd_current();
+    atomic_store(&t->cancelled,0);
+    __tce_watch_self = t;
+    __exp_frames = t->frames;
+    tss_set(__exp_frames_key,t);
+}
+
+// Consumes a cancellation delivered by the watchdog. Returns 1 if the frame it cancelled is still running.
+static inline int __tce_watch_take(void){
+    long long stamp = atomic_exchange(&__tce_watch_self->cancelled,0);
+    for (int i = (__exp_depth < TCE_MAX_FRAMES ? __exp_depth : TCE_MAX_FRAMES) - 1; i >= 0; --i)
+        if (atomic_load_explicit(&__exp_frames[i].entered,memory_order_relaxed) == stamp) return 1;
+    return 0;
+}
+
+#define __TCE_WATCH_CANCELLED() \
+    (__tce_watch_self && atomic_load_explicit(&__tce_watch_self->cancelled,memory_order_relaxed) && __tce_watch_take())
+#else
+static inline void __exp_frames_key_create(void){
+    if (tss_create(&__exp_frames_key,free) != thrd_success) abort();
+}
+
+static inline void __exp_frames_alloc(void){
+    call_once(&__exp_frames_once,__exp_frames_key_create);
+    __exp_frames = (tce_frame_desc*)malloc(TCE_MAX_FRAMES * sizeof(tce_frame_desc));
+    if (!__exp_frames) abort();
+    tss_set(__exp_frames_key,__exp_frames);
+}
+
+#define __TCE_WATCH_CANCELLED() 0
+#endif // TCE_WATCHDOG
+
+static inline void __exp_push_frame(__exp_frame* frame,const char* file,const char* func,int line){
+    if (__exp_depth < TCE_MAX_FRAMES){
+        tce_frame_desc* d;
+        if (!__exp_frames) __exp_frames_alloc();
+        d = &__exp_frames[__exp_depth];
+#ifdef TCE_WATCHDOG
+        // 0 while the descriptor is rewritten, so the watchdog never pairs a site with another's time.
+        atomic_store_explicit(&d->entered,0,memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+#endif
+        d->frame = frame;
+        d->file = file;
+        d->func = func;
+        d->line = line;
+#ifdef TCE_WATCHDOG
+        atomic_store_explicit(&d->limit_ms,0,memory_order_relaxed);
+        atomic_store_explicit(&d->entered,__tce_watch_now(),memory_order_release);
+#endif
+    }
+    ++__exp_depth;
+#ifdef TCE_WATCHDOG
+    if (__tce_watch_self) atomic_store_explicit(&__tce_watch_self->depth,__exp_depth,memory_order_release);
+#endif
+}
+
+#ifdef TCE_WATCHDOG
+static inline void __exp_pop_frame(void){
+    --__exp_depth;
+    if (__exp_depth < TCE_MAX_FRAMES){
+        // A cancellation of this frame that no checkpoint took ends with it.
+        long long stamp = atomic_load_explicit(&__tce_watch_self->cancelled,memory_order_relaxed);
+        if (stamp && stamp == atomic_load_explicit(&__exp_frames[__exp_depth].entered,memory_order_relaxed))
+            atomic_compare_exchange_strong(&__tce_watch_self->cancelled,&stamp,0);
+    }
+    atomic_store_explicit(&__tce_watch_self->depth,__exp_depth,memory_order_release);
+}
+
+#define __EXP_POP_FRAME() __exp_pop_frame();
+#else
+#define __EXP_POP_FRAME() --__exp_depth;
+#endif
+
+#define __EXP_PUSH_FRAME() __exp_push_frame(&__e_frame,__FILE__,__FUNCTION__,__LINE__);
+
+// Returns the number of active Try blocks on the calling thread.
+static inline int tce_depth(void){
+    return __exp_depth;
+}
+
+/**
+* @brief Returns the descriptor of an active Try. Index 0 is the outermost one.
+* @return The descriptor, or NULL if the index is out of range or was not recorded.
+*/
+static inline const tce_frame_desc* tce_frame_at(int index){
+    if (index < 0 || index >= __exp_depth || index >= TCE_MAX_FRAMES) return NULL;
+    return &__exp_frames[index];
+}
+
+// Prints the active Try blocks of the calling thread, innermost first.
+static inline void tce_frame_dump(FILE* out){
+    for (int i = __exp_depth - 1; i >= 0; --i){
+        const tce_frame_desc* d = tce_frame_at(i);
+        if (d) fprintf(out,"  #%d Try at %s:%d (%s)\n",i,d->file,d->line,d->func);
+        else fprintf(out,"  #%d Try (not recorded)\n",i);
+    }
+}
+#elif defined(TCE_STACK_STATS)
+thread_local static int __exp_depth = 0;
+
+#define __TCE_WATCH_CANCELLED() 0
+
+#define __EXP_PUSH_FRAME() ++__exp_depth;
+#define __EXP_POP_FRAME() --__exp_depth;
+
+// Returns the number of active Try blocks on the calling thread.
+static inline int tce_depth(void){
+    return __exp_depth;
+}
+#else
+#define __EXP_PUSH_FRAME()
+#define __EXP_POP_FRAME()
+#define __TCE_WATCH_CANCELLED() 0
+
+// Returns the number of active Try blocks on the calling thread.
+static inline int tce_depth(void){
+    int depth = 0;
+    for (__exp_frame* f = __exp_stack_top; f; f = f->prev) ++depth;
+    return depth;
+}
+#endif // TCE_FRAME_ARRAY
+
+thread_local static tce_scope __tce_scope = {0,0};
+
+// A thread-local struct to store details (file, function, line, scope...) for uncaught exceptions.
+thread_local static __exp_detail __exception_detail_s = {0,0,0,{0,0},0,0};
+
+#ifndef TCE_MAX_HANDLING
+#define TCE_MAX_HANDLING 16         // Nested Catch arms whose throw sites tce_current() can return.
+#endif
+
+// The frame whose Catch arm is running on this thread, or NULL.
+thread_local static __exp_frame* __tce_handling = NULL;
+
+// The throw details of the running Catch arms, by nesting level. A frame only keeps the code,
+// so a Try that never catches pays for the slot link alone, not for a copy of the details.
+thread_local static __exp_detail __tce_handled[TCE_MAX_HANDLING];
+
+// Records the throw site of an exception about to be thrown.
+static inline void __exp_detail_set(const char* file,const char* func,int line,void* payload){
+    __exception_detail_s.file = file;
+    __exception_detail_s.func = func;
+    __exception_detail_s.line = line;
+    __exception_detail_s.scope = __tce_scope;
+    __exception_detail_s.payload = payload;
+    __exception_detail_s.cause = __tce_handling ? __tce_handling->handled_code : 0;
+}
+
+// Called when a Catch arm starts: the frame becomes the thread's handling slot, and the throw
+// details are kept at its level, since a throw nested in the arm overwrites them.
+static inline void __exp_handle_begin(__exp_frame* frame){
+    int level = __tce_handling ? __tce_handling->handled_level + 1 : 0;
+    frame->handled_code = frame->error_code;
+    frame->handled_level = level;
+    frame->handling_prev = __tce_handling;
+    __tce_handling = frame;
+    if (level < TCE_MAX_HANDLING) __tce_handled[level] = __exception_detail_s;
+}
+
+// Clears the handling slot when the frame that set it ends.
+#define __EXP_HANDLE_END() \
+    if ((__e_frame.flag & 3) && __tce_handling == &__e_frame) __tce_handling = __e_frame.handling_prev;
+
+// A view of the exception being handled, returned by tce_current().
+typedef struct tce_exception_t{
+    int code;                    // 0 if no exception is being handled.
+    const char* file;            // Where it was thrown.
+    const char* func;
+    int line;
+    void* payload;               // The payload passed to ThrowWith, or NULL.
+    int cause;                   // The code that was being handled when it was thrown, or 0.
+    int depth;                   // The nesting depth of the handling Try, 1 for the outermost.
+    tce_scope scope;
+} tce_exception;
+
+/**
+* @brief Returns the exception being handled by the innermost running Catch arm of this thread.
+*        It works from any function called by the arm, until the arm's 'End'. For an arm nested
+*        in more than TCE_MAX_HANDLING others, only the code and the depth are known.
+*/
+static inline tce_exception tce_current(void){
+    tce_exception ex = {0,0,0,0,0,0,0,{0,0}};
+    __exp_frame* frame = __tce_handling;
+    if (frame){
+        ex.code = frame->handled_code;
+        if (frame->handled_level < TCE_MAX_HANDLING){
+            const __exp_detail* d = &__tce_handled[frame->handled_level];
+            ex.file = d->file;
+            ex.func = d->func;
+            ex.line = d->line;
+            ex.payload = d->payload;
+            ex.cause = d->cause;
+            ex.scope = d->scope;
+        }
+        for (; frame; frame = frame->prev) ++ex.depth;
+    }
+    return ex;
+}
+
+/*
+* Error catalog.
+*
+*   Define TCE_ERRORS before including this header to describe your exception codes once:
+*
+*     #define TCE_ERRORS(X) \
+*         X(InvalidInput, 1,   "invalid input") \
+*         X(FileNotFound, 201, "file not found")
+*
+*   It generates the enum, and tce_errname()/tce_strerror() resolve any code in constant time.
+*   The uncaught exception report prints the name and message of the code.
+*/
+
+// Exception codes reserved by the library. User codes should stay out of this range.
+#define __TCE_BUILTIN_ERRORS(X) \
+    X(TCE_AGGREGATE,-1000,"several errors were collected") \
+    X(TCE_BAD_POLICY,-1001,"the action policy could not be loaded") \
+    X(TCE_IO,-1002,"an I/O call failed") \
+    X(TCE_ISOLATE_CRASH,-1003,"the isolated worker process died") \
+    X(TCE_ISOLATE_TIMEOUT,-1004,"the isolated worker process timed out") \
+    X(TCE_ISOLATE_LIMIT,-1005,"the input does not fit the isolation buffer") \
+    X(TCE_CANCELLED,-1006,"the work was cancelled") \
+    X(TCE_REJECTED,-1007,"the bulkhead is full") \
+    X(TCE_INVALID_INPUT,-1008,"the input failed validation")
+
+#define __TCE_X_ENUM(name,code,message) name = (code),
+#define __TCE_X_INFO(name,code,message) {(code),#name,message},
+
+enum{ __TCE_BUILTIN_ERRORS(__TCE_X_ENUM) };
+
+#ifdef TCE_ERRORS
+enum tce_error_code{ TCE_ERRORS(__TCE_X_ENUM) };
+#endif
+
+// What should happen when a code is thrown. Catalogs generated by tools/tce_errgen carry a default per code.
+enum{
+    TCE_ACTION_NONE = 0,         // Normal handling only.
+    TCE_ACTION_LOG,              // Report every throw.
+    TCE_ACTION_SAMPLE,           // Report a sample of the throws.
+    TCE_ACTION_COUNT,            // Count only.
+    TCE_ACTION_ABORT             // Escalate: abort the program.
+};
+
+// An entry of the error catalog.
+typedef struct tce_error_info_t{
+    int code;
+    const char* name;
+    const char* message;
+} tce_error_info;
+
+static const tce_error_info __tce_catalog[] = {
+    __TCE_BUILTIN_ERRORS(__TCE_X_INFO)
+#ifdef TCE_ERRORS
+    TCE_ERRORS(__TCE_X_INFO)
+#endif
+};
+
+#define __TCE_CATALOG_SIZE (sizeof(__tce_catalog) / sizeof(__tce_catalog[0]))
+
+// A power of two at least twice the catalog size, so probe chains stay short.
+#define __TCE_CATALOG_BUCKETS \
+    (__TCE_CATALOG_SIZE <= 8 ? 16 : __TCE_CATALOG_SIZE <= 32 ? 64 : __TCE_CATALOG_SIZE <= 128 ? 256 : \
+     __TCE_CATALOG_SIZE <= 512 ? 1024 : __TCE_CATALOG_SIZE <= 2048 ? 4096 : __TCE_CATALOG_SIZE <= 8192 ? 16384 : 65536)
+
+// Open-addressed index of the catalog: catalog position + 1, 0 for an empty bucket.
+// Codes are their own hash, so dense codes land in distinct buckets (a direct index),
+// and sparse codes fall back to short linear probes.
+static int __tce_catalog_index[__TCE_CATALOG_BUCKETS];
+static once_flag __tce_catalog_once = ONCE_FLAG_INIT;
+
+static inline void __tce_catalog_build(void){
+    const unsigned mask = __TCE_CATALOG_BUCKETS - 1;
+    for (unsigned i = 0; i < __TCE_CATALOG_SIZE; ++i){
+        unsigned b = (unsigned)__tce_catalog[i].code & mask;
+        while (__tce_catalog_index[b] && __tce_catalog[__tce_catalog_index[b] - 1].code != __tce_catalog[i].code)
+            b = (b + 1) & mask;
+        if (!__tce_catalog_index[b]) __tce_catalog_index[b] = (int)i + 1;   // The first entry of a code wins.
+    }
+}
+
+/**
+* @brief Looks up an exception code in the catalog.
+* @return The catalog entry, or NULL if the code is unknown.
+*/
+static inline const tce_error_info* tce_error_lookup(int code){
+    const unsigned mask = __TCE_CATALOG_BUCKETS - 1;
+    unsigned b = (unsigned)code & mask;
+    call_once(&__tce_catalog_once,__tce_catalog_build);
+    while (__tce_catalog_index[b]){
+        const tce_error_info* info = &__tce_catalog[__tce_catalog_index[b] - 1];
+        if (info->code == code) return info;
+        b = (b + 1) & mask;
+    }
+    return NULL;
+}
+
+// Returns the enum name of a code, or NULL if the code is not in the catalog.
+static inline const char* tce_errname(int code){
+    const tce_error_info* info = tce_error_lookup(code);
+    return info ? info->name : NULL;
+}
+
+// Returns the message of a code, or "unknown error" if the code is not in the catalog.
+static inline const char* tce_strerror(int code){
+    const tce_error_info* info = tce_error_lookup(code);
+    return info ? info->message : "unknown error";
+}
 
 // A thread-local function pointer for a custom terminate handler.
 // If set, it will be called for uncaught exceptions instead of the default behavior.
 thread_local static const void (*__terminate_handle)(int) = NULL;
 
+// Sets the request and tenant the calling thread is working for. Use 0 for "none".
+static inline void tce_scope_set(unsigned long long request_id,unsigned long long tenant_id){
+    __tce_scope.request_id = request_id;
+    __tce_scope.tenant_id = tenant_id;
+}
+
+// Returns the calling thread's scope, to hand it to another thread, fiber or continuation.
+static inline tce_scope tce_scope_save(void){
+    return __tce_scope;
+}
+
+// Installs a scope obtained from tce_scope_save.
+static inline void tce_scope_restore(tce_scope scope){
+    __tce_scope = scope;
+}
+
+/*
+* Exception statistics (define TCE_ENABLE_STATS before including this header).
+*
+*   Every thread counts its throws, catches and uncaught exceptions in its own block, so the
+*   hot path has no shared writes. Throws are also counted per tenant in a Space-Saving top-K
+*   sketch: memory stays fixed however many tenants there are. tce_stats_snapshot() merges
+*   every thread's block.
+*
+*   Each block also counts throws per code and per site, and keeps histograms of how many
+*   frames an exception crossed before it was caught and of the time from throw to catch.
+*   These are updated under a per-thread seqlock, so tce_stats_detail_snapshot() reads
+*   consistent tables without ever blocking the owner.
+*
+*   With TCE_STACK_STATS (which implies TCE_ENABLE_STATS), every Try also records, per thread
+*   and per site, the peak nesting depth and the peak stack offset of its frame, to size thread
+*   and fiber stacks. Offsets are measured from the thread's stack base: call tce_stack_mark_base()
+*   first thing in the thread's entry function. Otherwise the highest frame seen is the base.
+*
+*   With TCE_STATS_PERCPU (which implies TCE_ENABLE_STATS, Linux only), the blocks belong to CPUs
+*   instead of threads, so memory follows the core count rather than the thread count. The CPU is
+*   read from the thread's rseq area (glibc 2.35+), or from sched_getcpu(). A thread may be moved
+*   to another CPU mid-update, so the counters use relaxed atomic adds on the CPU's cache lines,
+*   and the detail tables are read without the seqlock: each counter is exact, but a snapshot may
+*   see a throw counted per code and not yet per site. Tenant evictions take their slot with a
+*   CAS. The top-K stays approximate, as Space-Saving is: two threads that scan at the same time
+*   may install one tenant in two slots (a snapshot adds them up), and a count added while its
+*   slot is evicted goes to the new tenant.
+*/
+#if defined(TCE_STATS_PERCPU) && !defined(TCE_ENABLE_STATS)
+#define TCE_ENABLE_STATS
+#endif
+
+#if defined(TCE_STACK_STATS) && !defined(TCE_ENABLE_STATS)
+#define TCE_ENABLE_STATS
+#endif
+
+#ifdef TCE_ENABLE_STATS
+
+#ifndef TCE_STATS_TOPK
+#define TCE_STATS_TOPK 16        // Tenants tracked per thread and reported by a snapshot.
+#endif
+
+#ifndef TCE_STATS_CODES
+#define TCE_STATS_CODES 64       // Distinct codes counted per thread (a power of two).
+#endif
+
+#ifndef TCE_STATS_SITES
+#define TCE_STATS_SITES 128      // Distinct throw sites counted per thread (a power of two).
+#endif
+
+#define TCE_STATS_DEPTHS 16      // Unwind depth buckets: 0 .. 14 frames crossed, then 15 and more.
+#define TCE_STATS_LATENCIES 32   // Latency buckets: bucket i counts catches within 2^i ns.
+
+// A tenant of the top-K sketch. 'throws' may overestimate the true count by at most 'error'.
+typedef struct tce_stats_tenant_t{
+    unsigned long long tenant_id;
+    unsigned long long throws;
+    unsigned long long error;
+} tce_stats_tenant;
+
+// A merged view of the statistics of every thread.
+typedef struct tce_stats_t{
+    unsigned long long throws;
+    unsigned long long catches;
+    unsigned long long uncaught;
+    int ntenants;
+    tce_stats_tenant tenants[TCE_STATS_TOPK];   // Heaviest tenants first.
+#ifdef TCE_STACK_STATS
+    int max_depth;                              // The deepest nesting of Try blocks on any thread.
+    size_t max_stack;                           // The deepest frame, in bytes from its thread's stack base.
+#endif
+} tce_stats;
+
+// Throws of one code, or of one site.
+typedef struct tce_stats_code_t{
+    int code;
+    unsigned long long throws;
+} tce_stats_code;
+
+typedef struct tce_stats_site_t{
+    const char* file;
+    int line;
+    unsigned long long throws;
+} tce_stats_site;
+
+// A merged view of the per-code, per-site and histogram statistics of every thread.
+// Throws that did not fit a table are counted in 'other_codes' / 'other_sites'.
+typedef struct tce_stats_detail_t{
+    int ncodes;
+    tce_stats_code codes[TCE_STATS_CODES];
+    unsigned long long other_codes;
+    int nsites;
+    tce_stats_site sites[TCE_STATS_SITES];
+    unsigned long long other_sites;
+    unsigned long long unwind[TCE_STATS_DEPTHS];        // Catches by number of frames crossed.
+    unsigned long long unwind_sum;
+    unsigned long long latency[TCE_STATS_LATENCIES];    // Catches by throw-to-catch time.
+    unsigned long long latency_sum_ns;
+} tce_stats_detail;
+
+// The statistics of one thread (or one CPU with TCE_STATS_PERCPU). Written by its owner only, read by snapshots.
+typedef struct __tce_stats_block_t{
+    struct __tce_stats_block_t* next;
+    atomic_ullong throws;
+    atomic_ullong catches;
+    atomic_ullong uncaught;
+    struct{
+        atomic_ullong tenant_id;
+        atomic_ullong throws;
+        atomic_ullong error;
+    } tenants[TCE_STATS_TOPK];
+    atomic_uint seq;              // Seqlock of the fields below: odd while the owner updates them.
+    struct{
+        atomic_int code;          // 0 for a free entry.
+        atomic_ullong throws;
+    } codes[TCE_STATS_CODES];
+    atomic_ullong other_codes;
+    struct{
+        _Atomic(const char*) file;    // NULL for a free entry.
+        atomic_int line;
+        atomic_ullong throws;
+    } sites[TCE_STATS_SITES];
+    atomic_ullong other_sites;
+    atomic_ullong unwind[TCE_STATS_DEPTHS];
+    atomic_ullong unwind_sum;
+    atomic_ullong latency[TCE_STATS_LATENCIES];
+    atomic_ullong latency_sum_ns;
+#ifdef TCE_STACK_STATS
+    atomic_int max_depth;
+    atomic_size_t max_stack;
+#endif
+} __tce_stats_block;
+
+// Every block. Blocks outlive their threads so their counts stay in the totals.
+static _Atomic(__tce_stats_block*) __tce_stats_registry = NULL;
+
+#define __TCE_STAT_GET(field) atomic_load_explicit(&(field),memory_order_relaxed)
+
+// Raises an atomic to 'value' if it's lower.
+#define __TCE_ATOMIC_MAX(field,value) \
+    do { \
+        __typeof__(value) __max_seen = atomic_load_explicit(&(field),memory_order_relaxed); \
+        while (__max_seen < (value) && !atomic_compare_exchange_weak_explicit(&(field),&__max_seen,(value), \
+            memory_order_relaxed,memory_order_relaxed)); \
+    } while(0)
+
+static inline void __tce_stats_register(__tce_stats_block* block){
+    block->next = atomic_load(&__tce_stats_registry);
+    while (!atomic_compare_exchange_weak(&__tce_stats_registry,&block->next,block));
+}
+
+#ifdef TCE_STATS_PERCPU
+#include <stddef.h>
+
+#ifndef TCE_STATS_CPUS
+#define TCE_STATS_CPUS 256       // CPU slots. Higher CPU numbers share slots.
+#endif
+
+// The rseq area glibc registers for every thread. Weak, so older C libraries fall back to sched_getcpu().
+extern const ptrdiff_t __rseq_offset __attribute__((weak));
+extern const unsigned int __rseq_size __attribute__((weak));
+extern int sched_getcpu(void);
+
+// Every CPU's block, allocated on the first throw on that CPU.
+static _Atomic(__tce_stats_block*) __tce_stats_cpus[TCE_STATS_CPUS];
+
+// Several threads share a block: the increments are atomic, but uncontended unless a thread was moved mid-update.
+#define __TCE_STAT_ADD(field,n) atomic_fetch_add_explicit(&(field),(n),memory_order_relaxed)
+#define __TCE_STAT_MAX(field,value) __TCE_ATOMIC_MAX(field,value)
+
+// Returns the CPU the calling thread is running on.
+static inline unsigned __tce_stats_cpu(void){
+    int cpu;
+#if defined(__has_builtin)
+#if __has_builtin(__builtin_thread_pointer)
+    if (&__rseq_size && __rseq_size){
+        // The cpu_id field follows cpu_id_start. It's negative while rseq is not registered.
+        cpu = *(volatile const int*)((char*)__builtin_thread_pointer() + __rseq_offset + sizeof(int));
+        if (cpu >= 0) return (unsigned)cpu;
+    }
+#endif
+#endif
+    cpu = sched_getcpu();
+    return cpu < 0 ? 0 : (unsigned)cpu;
+}
+
+static inline __tce_stats_block* __tce_stats_block_get(void){
+    _Atomic(__tce_stats_block*)* slot = &__tce_stats_cpus[__tce_stats_cpu() % TCE_STATS_CPUS];
+    __tce_stats_block* block = atomic_load_explicit(slot,memory_order_acquire);
+    if (!block){
+        __tce_stats_block* fresh = NULL;
+        // Blocks start on their own cache lines, so CPUs never share one.
+        size_t size = (sizeof(__tce_stats_block) + 63) & ~(size_t)63;
+        fresh = (__tce_stats_block*)aligned_alloc(64,size);
+        if (!fresh) abort();
+        memset(fresh,0,size);
+        if (atomic_compare_exchange_strong(slot,&block,fresh)){
+            __tce_stats_register(fresh);
+            block = fresh;
+        }
+        else free(fresh);
+    }
+    return block;
+}
+
+// Several writers: the seqlock can't be kept. Snapshots read each counter atomically instead.
+static inline void __tce_stats_write_begin(__tce_stats_block* block){
+    (void)block;
+}
+
+static inline void __tce_stats_write_end(__tce_stats_block* block){
+    (void)block;
+}
+#else
+thread_local static __tce_stats_block* __tce_stats_local = NULL;
+
+// A single-writer increment: no atomic read-modify-write is needed.
+#define __TCE_STAT_ADD(field,n) \
+    atomic_store_explicit(&(field),atomic_load_explicit(&(field),memory_order_relaxed) + (n),memory_order_relaxed)
+#define __TCE_STAT_MAX(field,value) \
+    do { if ((value) > __TCE_STAT_GET(field)) atomic_store_explicit(&(field),(value),memory_order_relaxed); } while(0)
+
+static inline void __tce_stats_write_begin(__tce_stats_block* block){
+    atomic_store_explicit(&block->seq,atomic_load_explicit(&block->seq,memory_order_relaxed) + 1,memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+static inline void __tce_stats_write_end(__tce_stats_block* block){
+    atomic_store_explicit(&block->seq,atomic_load_explicit(&block->seq,memory_order_relaxed) + 1,memory_order_release);
+}
+
+static inline __tce_stats_block* __tce_stats_block_get(void){
+    __tce_stats_block* block = __tce_stats_local;
+    if (!block){
+        block = (__tce_stats_block*)calloc(1,sizeof(__tce_stats_block));
+        if (!block) abort();
+        __tce_stats_register(block);
+        __tce_stats_local = block;
+    }
+    return block;
+}
+#endif // TCE_STATS_PERCPU
+
+// The throw being unwound on this thread: when it was thrown, and how many frames it crossed.
+thread_local static struct timespec __tce_stats_thrown_at;
+thread_local static unsigned __tce_stats_unwound = 0;
+
+// Counts one throw for a tenant in the Space-Saving sketch of a block.
+static inline void __tce_stats_tenant_add(__tce_stats_block* block,unsigned long long tenant_id){
+    for (;;){
+        int min = 0;
+        unsigned long long min_id = 0;
+        for (int i = 0; i < TCE_STATS_TOPK; ++i){
+            unsigned long long id = __TCE_STAT_GET(block->tenants[i].tenant_id);
+            if (id == tenant_id){
+                __TCE_STAT_ADD(block->tenants[i].throws,1);
+                return;
+            }
+            if (!i || __TCE_STAT_GET(block->tenants[i].throws) < __TCE_STAT_GET(block->tenants[min].throws)){
+                min = i;
+                min_id = id;
+            }
+        }
+        // Not tracked: it replaces the lightest tenant and inherits its count as the error bound.
+        // With TCE_STATS_PERCPU, another thread of the CPU may be evicting too: the one whose CAS
+        // fails scans again, so a slot is not taken twice and a tenant that won a slot is found.
+        if (!atomic_compare_exchange_strong_explicit(&block->tenants[min].tenant_id,&min_id,tenant_id,
+            memory_order_relaxed,memory_order_relaxed)) continue;
+        atomic_store_explicit(&block->tenants[min].error,__TCE_STAT_GET(block->tenants[min].throws),memory_order_relaxed);
+        __TCE_STAT_ADD(block->tenants[min].throws,1);
+        return;
+    }
+}
+
+static inline void __tce_stats_throw(int code){
+    __tce_stats_block* block = __tce_stats_block_get();
+    const char* file = __exception_detail_s.file;
+    int line = __exception_detail_s.line;
+    unsigned i, probes;
+    __TCE_STAT_ADD(block->throws,1);
+    if (__tce_scope.tenant_id) __tce_stats_tenant_add(block,__tce_scope.tenant_id);
+    __tce_stats_write_begin(block);
+    for (i = (unsigned)code & (TCE_STATS_CODES - 1), probes = 0; probes < TCE_STATS_CODES; i = (i + 1) & (TCE_STATS_CODES - 1), ++probes){
+        int c = __TCE_STAT_GET(block->codes[i].code);
+        if (!c && atomic_compare_exchange_strong_explicit(&block->codes[i].code,&c,code,memory_order_relaxed,memory_order_relaxed)) c = code;
+        if (c == code) break;
+    }
+    if (probes < TCE_STATS_CODES) __TCE_STAT_ADD(block->codes[i].throws,1);
+    else __TCE_STAT_ADD(block->other_codes,1);
+    for (i = (unsigned)(((size_t)file >> 3) ^ ((unsigned)line * 2654435761u)) & (TCE_STATS_SITES - 1), probes = 0;
+        probes < TCE_STATS_SITES; i = (i + 1) & (TCE_STATS_SITES - 1), ++probes){
+        const char* f = atomic_load_explicit(&block->sites[i].file,memory_order_acquire);
+        if (!f){
+            int free_line = 0;
+            // The line is claimed first, so a site is never seen with another site's line.
+            if (atomic_compare_exchange_strong(&block->sites[i].line,&free_line,line)){
+                atomic_store_explicit(&block->sites[i].file,file,memory_order_release);
+                break;
+            }
+            if (free_line == line) while (!(f = atomic_load_explicit(&block->sites[i].file,memory_order_acquire))) thrd_yield();
+            else continue;
+        }
+        if (f == file && __TCE_STAT_GET(block->sites[i].line) == line) break;
+    }
+    if (probes < TCE_STATS_SITES) __TCE_STAT_ADD(block->sites[i].throws,1);
+    else __TCE_STAT_ADD(block->other_sites,1);
+    __tce_stats_write_end(block);
+    __tce_stats_unwound = 0;
+    timespec_get(&__tce_stats_thrown_at,TIME_UTC);
+}
+
+// An unhandled exception left its frame at 'End'.
+static inline void __tce_stats_unwind(void){
+    ++__tce_stats_unwound;
+}
+
+static inline void __tce_stats_catch(void){
+    __tce_stats_block* block = __tce_stats_block_get();
+    struct timespec now;
+    long long ns;
+    int bucket = 0;
+    timespec_get(&now,TIME_UTC);
+    ns = (long long)(now.tv_sec - __tce_stats_thrown_at.tv_sec) * 1000000000LL + (now.tv_nsec - __tce_stats_thrown_at.tv_nsec);
+    if (ns < 0) ns = 0;
+    while (bucket < TCE_STATS_LATENCIES - 1 && (1LL << bucket) < ns) ++bucket;
+    __TCE_STAT_ADD(block->catches,1);
+    __tce_stats_write_begin(block);
+    __TCE_STAT_ADD(block->unwind[__tce_stats_unwound < TCE_STATS_DEPTHS ? __tce_stats_unwound : TCE_STATS_DEPTHS - 1],1);
+    __TCE_STAT_ADD(block->unwind_sum,__tce_stats_unwound);
+    __TCE_STAT_ADD(block->latency[bucket],1);
+    __TCE_STAT_ADD(block->latency_sum_ns,(unsigned long long)ns);
+    __tce_stats_write_end(block);
+}
+
+static inline void __tce_stats_uncaught(void){
+    __TCE_STAT_ADD(__tce_stats_block_get()->uncaught,1);
+}
+
+// Adds a tenant entry to a merged top-K list, evicting the lightest entry when it's full.
+static inline void __tce_stats_merge_tenant(tce_stats* out,unsigned long long id,unsigned long long throws,unsigned long long error){
+    int min = 0;
+    for (int i = 0; i < out->ntenants; ++i){
+        if (out->tenants[i].tenant_id == id){
+            out->tenants[i].throws += throws;
+            out->tenants[i].error += error;
+            return;
+        }
+        if (out->tenants[i].throws < out->tenants[min].throws) min = i;
+    }
+    if (out->ntenants < TCE_STATS_TOPK) min = out->ntenants++;
+    else if (out->tenants[min].throws >= throws) return;
+    out->tenants[min].tenant_id = id;
+    out->tenants[min].throws = throws;
+    out->tenants[min].error = error;
+}
+
+/**
+* @brief Merges the statistics of every thread. Workers are never paused.
+* @param out Receives the totals and the heaviest tenants, sorted by throws.
+*/
+static inline void tce_stats_snapshot(tce_stats* out){
+    out->throws = out->catches = out->uncaught = 0;
+    out->ntenants = 0;
+#ifdef TCE_STACK_STATS
+    out->max_depth = 0;
+    out->max_stack = 0;
+#endif
+    for (__tce_stats_block* b = atomic_load(&__tce_stats_registry); b; b = b->next){
+        out->throws += __TCE_STAT_GET(b->throws);
+        out->catches += __TCE_STAT_GET(b->catches);
+        out->uncaught += __TCE_STAT_GET(b->uncaught);
+#ifdef TCE_STACK_STATS
+        if (__TCE_STAT_GET(b->max_depth) > out->max_depth) out->max_depth = __TCE_STAT_GET(b->max_depth);
+        if (__TCE_STAT_GET(b->max_stack) > out->max_stack) out->max_stack = __TCE_STAT_GET(b->max_stack);
+#endif
+        for (int i = 0; i < TCE_STATS_TOPK; ++i){
+            unsigned long long id = __TCE_STAT_GET(b->tenants[i].tenant_id);
+            if (id) __tce_stats_merge_tenant(out,id,__TCE_STAT_GET(b->tenants[i].throws),__TCE_STAT_GET(b->tenants[i].error));
+        }
+    }
+    for (int i = 1; i < out->ntenants; ++i){
+        tce_stats_tenant t = out->tenants[i];
+        int j = i;
+        for (; j > 0 && out->tenants[j - 1].throws < t.throws; --j) out->tenants[j] = out->tenants[j - 1];
+        out->tenants[j] = t;
+    }
+}
+
+// Adds a block's detail to a merged view. Returns 0 if the owner was writing: retry.
+static inline int __tce_stats_detail_merge(tce_stats_detail* out,__tce_stats_block* b){
+    tce_stats_detail add;
+    unsigned seq = atomic_load_explicit(&b->seq,memory_order_acquire);
+    int ncodes = 0, nsites = 0;
+    if (seq & 1) return 0;
+    for (int i = 0; i < TCE_STATS_CODES; ++i){
+        add.codes[ncodes].code = __TCE_STAT_GET(b->codes[i].code);
+        add.codes[ncodes].throws = __TCE_STAT_GET(b->codes[i].throws);
+        if (add.codes[ncodes].code) ++ncodes;
+    }
+    add.other_codes = __TCE_STAT_GET(b->other_codes);
+    for (int i = 0; i < TCE_STATS_SITES; ++i){
+        add.sites[nsites].file = atomic_load_explicit(&b->sites[i].file,memory_order_relaxed);
+        add.sites[nsites].line = __TCE_STAT_GET(b->sites[i].line);
+        add.sites[nsites].throws = __TCE_STAT_GET(b->sites[i].throws);
+        if (add.sites[nsites].file) ++nsites;
+    }
+    add.other_sites = __TCE_STAT_GET(b->other_sites);
+    for (int i = 0; i < TCE_STATS_DEPTHS; ++i) add.unwind[i] = __TCE_STAT_GET(b->unwind[i]);
+    add.unwind_sum = __TCE_STAT_GET(b->unwind_sum);
+    for (int i = 0; i < TCE_STATS_LATENCIES; ++i) add.latency[i] = __TCE_STAT_GET(b->latency[i]);
+    add.latency_sum_ns = __TCE_STAT_GET(b->latency_sum_ns);
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit(&b->seq,memory_order_relaxed) != seq) return 0;
+
+    for (int i = 0; i < ncodes; ++i){
+        int j = 0;
+        while (j < out->ncodes && out->codes[j].code != add.codes[i].code) ++j;
+        if (j < out->ncodes) out->codes[j].throws += add.codes[i].throws;
+        else if (j < TCE_STATS_CODES) out->codes[out->ncodes++] = add.codes[i];
+        else out->other_codes += add.codes[i].throws;
+    }
+    out->other_codes += add.other_codes;
+    for (int i = 0; i < nsites; ++i){
+        int j = 0;
+        while (j < out->nsites && (out->sites[j].file != add.sites[i].file || out->sites[j].line != add.sites[i].line)) ++j;
+        if (j < out->nsites) out->sites[j].throws += add.sites[i].throws;
+        else if (j < TCE_STATS_SITES) out->sites[out->nsites++] = add.sites[i];
+        else out->other_sites += add.sites[i].throws;
+    }
+    out->other_sites += add.other_sites;
+    for (int i = 0; i < TCE_STATS_DEPTHS; ++i) out->unwind[i] += add.unwind[i];
+    out->unwind_sum += add.unwind_sum;
+    for (int i = 0; i < TCE_STATS_LATENCIES; ++i) out->latency[i] += add.latency[i];
+    out->latency_sum_ns += add.latency_sum_ns;
+    return 1;
+}
+
+/**
+* @brief Merges the per-code, per-site and histogram statistics of every thread.
+*        Each block is read under its seqlock: a read that raced with its owner is retried,
+*        and the owner never waits.
+*/
+static inline void tce_stats_detail_snapshot(tce_stats_detail* out){
+    memset(out,0,sizeof(*out));
+    for (__tce_stats_block* b = atomic_load(&__tce_stats_registry); b; b = b->next)
+        while (!__tce_stats_detail_merge(out,b)) thrd_yield();
+}
+
+#define __TCE_STATS_THROW(code) __tce_stats_throw(code);
+#define __TCE_STATS_CATCH() __tce_stats_catch();
+#define __TCE_STATS_UNCAUGHT() __tce_stats_uncaught();
+#define __TCE_STATS_UNWIND() __tce_stats_unwind();
+
+#ifdef TCE_STACK_STATS
+// The peaks of one Try site, over every thread.
+typedef struct tce_stack_site_t{
+    const char* file;
+    const char* func;
+    int line;
+    int max_depth;
+    size_t max_stack;
+} tce_stack_site;
+
+// The record of a Try site. One static record per Try expansion.
+typedef struct __tce_stack_rec_t{
+    const char* file;
+    int line;
+    const char* func;
+    atomic_int max_depth;
+    atomic_size_t max_stack;
+    atomic_int registered;
+    struct __tce_stack_rec_t* next;
+} __tce_stack_rec;
+
+static _Atomic(__tce_stack_rec*) __tce_stack_sites = NULL;
+thread_local static char* __tce_stack_base = NULL;
+
+// Sets the stack base of the calling thread, from which frame offsets are measured.
+static inline void tce_stack_base_set(void* base){
+    __tce_stack_base = (char*)base;
+}
+
+#define tce_stack_mark_base() do { char __tce_base_mark; tce_stack_base_set(&__tce_base_mark); } while(0)
+
+static inline void __tce_stack_probe(__tce_stack_rec* site,__exp_frame* frame,const char* func){
+    char* top = (char*)(frame + 1);     // The stack grows down: the frame ends at its highest address.
+    size_t offset;
+    int depth = __exp_depth;
+    __tce_stats_block* block = __tce_stats_block_get();
+    if (!__tce_stack_base || top > __tce_stack_base) __tce_stack_base = top;
+    offset = (size_t)(__tce_stack_base - (char*)frame);
+    if (depth > __TCE_STAT_GET(block->max_depth)) __TCE_STAT_MAX(block->max_depth,depth);
+    if (offset > __TCE_STAT_GET(block->max_stack)) __TCE_STAT_MAX(block->max_stack,offset);
+    if (depth > atomic_load_explicit(&site->max_depth,memory_order_relaxed)) __TCE_ATOMIC_MAX(site->max_depth,depth);
+    if (offset > atomic_load_explicit(&site->max_stack,memory_order_relaxed)) __TCE_ATOMIC_MAX(site->max_stack,offset);
+    if (!atomic_load_explicit(&site->registered,memory_order_acquire) && !atomic_exchange(&site->registered,1)){
+        site->func = func;
+        site->next = atomic_load(&__tce_stack_sites);
+        while (!atomic_compare_exchange_weak(&__tce_stack_sites,&site->next,site));
+    }
+}
+
+/**
+* @brief Copies the peaks of the Try sites entered so far, deepest stack first.
+* @return The number of sites written to 'out' (at most 'max').
+*/
+static inline int tce_stack_sites(tce_stack_site* out,int max){
+    int n = 0;
+    for (__tce_stack_rec* r = atomic_load(&__tce_stack_sites); r; r = r->next){
+        tce_stack_site s = {r->file,r->func,r->line,atomic_load(&r->max_depth),atomic_load(&r->max_stack)};
+        int j = n < max ? n++ : max;
+        for (; j > 0 && out[j - 1].max_stack < s.max_stack; --j) if (j < max) out[j] = out[j - 1];
+        if (j < max) out[j] = s;
+    }
+    return n;
+}
+
+#define __EXP_STACK_PROBE() \
+        static __tce_stack_rec __tce_stack_site = {.file = __FILE__,.line = __LINE__}; \
+        __tce_stack_probe(&__tce_stack_site,&__e_frame,__FUNCTION__);
+#else
+#define __EXP_STACK_PROBE()
+#endif // TCE_STACK_STATS
+#else
+#define __EXP_STACK_PROBE()
+#define __TCE_STATS_THROW(code)
+#define __TCE_STATS_CATCH()
+#define __TCE_STATS_UNCAUGHT()
+#define __TCE_STATS_UNWIND()
+#endif // TCE_ENABLE_STATS
+
+#ifdef TCE_ENABLE_POLICY
+static inline void __tce_policy_throw(int code);
+static inline void __tce_policy_report(int code);
+#define __TCE_POLICY_THROW(code) __tce_policy_throw(code);
+#define __TCE_POLICY_REPORT(code) __tce_policy_report(code);
+#else
+#define __TCE_POLICY_THROW(code)
+#define __TCE_POLICY_REPORT(code)
+#endif // TCE_ENABLE_POLICY
+
 /**
 * @brief Sets a custom handler function for uncaught exceptions.
 * @param terminate_handle A function pointer that takes an integer (the error code) and returns void.
@@ -74,6 +1065,366 @@ void set_exception_terminate_handle(void (*terminate_handle)(int)){
     __terminate_handle = terminate_handle;
 }
 
+static inline void __tce_collect_report(int code);
+
+// Prints the details of an exception that ends the program, then aborts.
+static inline void __tce_abort_report(const char* title,int code){
+    const tce_error_info* info = tce_error_lookup(code);
+    printf("\n--- %s ---\nError Code: %d",title,code);
+    if (info) printf(" (%s: %s)",info->name,info->message);
+    printf("\nAt -> %s\nFunc -> %s\nLine -> %d\n",
+        __exception_detail_s.file,__exception_detail_s.func,__exception_detail_s.line);
+    if (__exception_detail_s.scope.request_id || __exception_detail_s.scope.tenant_id)
+        printf("Request -> %llu\nTenant -> %llu\n",__exception_detail_s.scope.request_id,__exception_detail_s.scope.tenant_id);
+    __TCE_POLICY_REPORT(code)
+    __tce_collect_report(code);
+    printf("--- PROGRAM WILL ABORT ---\n");
+    fflush(stdout);
+    abort();
+}
+
+/*
+* Leak check (define TCE_LEAK_CHECK before including this header).
+*
+*   A longjmp skips the cleanup code of every frame it unwinds, so error paths leak. In this
+*   mode tce_malloc, tce_calloc and tce_realloc tag each block with its allocation site and
+*   a per-thread sequence number, and every Try records the sequence number on entry. When an
+*   exception unwinds past a frame (its 'End' re-throws), the blocks of the thread allocated
+*   since the frame was entered and still live are reported with their allocation site and the
+*   throw site, unless a cleanup owns them: tce_guard(p) marks a block that a Finally, a
+*   handler or an outer structure will free. Each block is reported once.
+*
+*   The live blocks of a thread are kept newest first, so the check at 'End' only visits the
+*   blocks allocated inside the frame. Each allocation and free costs an uncontended lock of
+*   the list the block belongs to, so blocks may be freed from any thread. Without
+*   TCE_LEAK_CHECK, the functions are plain malloc, calloc, realloc and free.
+*/
+
+#ifdef TCE_LEAK_CHECK
+#include <stddef.h>
+
+// A leaked block.
+typedef struct tce_leak_t{
+    void* ptr;
+    size_t size;
+    const char* file;            // The allocation site.
+    int line;
+    int code;                    // The exception that abandoned the block.
+    __exp_detail thrown;         // Its throw site.
+} tce_leak;
+
+// The header of a tracked block, in front of the user's bytes.
+typedef struct __tce_block_t{
+    struct __tce_block_t* prev;  // Newer.
+    struct __tce_block_t* next;  // Older.
+    struct __tce_blocks_t* list;
+    unsigned long long seq;
+    const char* file;
+    int line;
+    unsigned char guarded;
+    unsigned char reported;
+    size_t size;
+} __tce_block;
+
+// The live blocks allocated by one thread. Lists are never freed: their blocks may outlive the thread.
+typedef struct __tce_blocks_t{
+    mtx_t lock;
+    __tce_block* head;           // The newest block.
+} __tce_blocks;
+
+#define __TCE_BLOCK_HEADER ((sizeof(__tce_block) + _Alignof(max_align_t) - 1) & ~(_Alignof(max_align_t) - 1))
+
+thread_local static __tce_blocks* __tce_blocks_self = NULL;
+thread_local static unsigned long long __tce_block_seq = 0;
+static void (*__tce_leak_handler)(const tce_leak*) = NULL;
+static atomic_ullong __tce_leaks = 0;
+
+/**
+* @brief Sets the function that receives every leak, on the thread that unwound it.
+*        The handler runs with the thread's list locked, so it must not use tce_malloc or tce_free.
+*        Pass NULL to print leaks to stderr.
+*/
+static inline void tce_leak_set_handler(void (*handler)(const tce_leak* leak)){
+    __tce_leak_handler = handler;
+}
+
+// Returns the number of leaks reported so far.
+static inline unsigned long long tce_leak_count(void){
+    return atomic_load_explicit(&__tce_leaks,memory_order_relaxed);
+}
+
+static inline __tce_block* __tce_block_of(void* p){
+    return (__tce_block*)((char*)p - __TCE_BLOCK_HEADER);
+}
+
+// Links a new block as the newest of the calling thread.
+static inline void* __tce_block_track(__tce_block* b,size_t size,const char* file,int line){
+    __tce_blocks* list = __tce_blocks_self;
+    if (!b) return NULL;
+    if (!list){
+        list = (__tce_blocks*)malloc(sizeof(__tce_blocks));
+        if (!list) abort();
+        mtx_init(&list->lock,mtx_plain);
+        list->head = NULL;
+        __tce_blocks_self = list;
+    }
+    b->list = list;
+    b->seq = __tce_block_seq++;
+    b->file = file;
+    b->line = line;
+    b->guarded = 0;
+    b->reported = 0;
+    b->size = size;
+    b->prev = NULL;
+    mtx_lock(&list->lock);
+    b->next = list->head;
+    if (b->next) b->next->prev = b;
+    list->head = b;
+    mtx_unlock(&list->lock);
+    return (char*)b + __TCE_BLOCK_HEADER;
+}
+
+static inline void* __tce_malloc(size_t size,const char* file,int line){
+    if (size > (size_t)-1 - __TCE_BLOCK_HEADER) return NULL;
+    return __tce_block_track((__tce_block*)malloc(__TCE_BLOCK_HEADER + size),size,file,line);
+}
+
+static inline void* __tce_calloc(size_t count,size_t size,const char* file,int line){
+    if (size && count > ((size_t)-1 - __TCE_BLOCK_HEADER) / size) return NULL;
+    return __tce_block_track((__tce_block*)calloc(1,__TCE_BLOCK_HEADER + count * size),count * size,file,line);
+}
+
+static inline void __tce_free(void* p){
+    __tce_block* b;
+    if (!p) return;
+    b = __tce_block_of(p);
+    mtx_lock(&b->list->lock);
+    if (b->prev) b->prev->next = b->next;
+    else b->list->head = b->next;
+    if (b->next) b->next->prev = b->prev;
+    mtx_unlock(&b->list->lock);
+    free(b);
+}
+
+// The block keeps its place in its list: it's still as old as its first allocation.
+static inline void* __tce_realloc(void* p,size_t size,const char* file,int line){
+    __tce_block* b;
+    __tce_block* moved;
+    __tce_blocks* list;
+    if (!p) return __tce_malloc(size,file,line);
+    if (size > (size_t)-1 - __TCE_BLOCK_HEADER) return NULL;    // 'p' is left as it was, as by realloc.
+    b = __tce_block_of(p);
+    list = b->list;
+    mtx_lock(&list->lock);
+    moved = (__tce_block*)realloc(b,__TCE_BLOCK_HEADER + size);
+    if (moved){
+        if (moved->prev) moved->prev->next = moved;
+        else list->head = moved;
+        if (moved->next) moved->next->prev = moved;
+        moved->size = size;
+    }
+    mtx_unlock(&list->lock);
+    return moved ? (char*)moved + __TCE_BLOCK_HEADER : NULL;
+}
+
+static inline void __tce_guard_set(void* p,unsigned char guarded){
+    if (p){
+        __tce_block* b = __tce_block_of(p);
+        mtx_lock(&b->list->lock);
+        b->guarded = guarded;
+        mtx_unlock(&b->list->lock);
+    }
+}
+
+static inline void __tce_leak_print(const tce_leak* leak){
+    const tce_error_info* info = tce_error_lookup(leak->code);
+    fprintf(stderr,"tce leak: %zu bytes at %p allocated at %s:%d, abandoned by error %d%s%s thrown at %s:%d (%s)\n",
+        leak->size,leak->ptr,leak->file,leak->line,leak->code,info ? " " : "",info ? info->name : "",
+        leak->thrown.file,leak->thrown.line,leak->thrown.func);
+}
+
+// Reports the live, unguarded blocks allocated since 'frame' was entered. 'frame' is being unwound.
+static inline void __tce_leak_unwind(__exp_frame* frame){
+    __tce_blocks* list = __tce_blocks_self;
+    void (*handler)(const tce_leak*) = __tce_leak_handler ? __tce_leak_handler : __tce_leak_print;
+    if (!list || __tce_block_seq == frame->leak_mark) return;
+    mtx_lock(&list->lock);
+    for (__tce_block* b = list->head; b && b->seq >= frame->leak_mark; b = b->next){
+        tce_leak leak;
+        if (b->guarded || b->reported) continue;
+        b->reported = 1;
+        leak.ptr = (char*)b + __TCE_BLOCK_HEADER;
+        leak.size = b->size;
+        leak.file = b->file;
+        leak.line = b->line;
+        leak.code = frame->error_code;
+        leak.thrown = __exception_detail_s;
+        atomic_fetch_add_explicit(&__tce_leaks,1,memory_order_relaxed);
+        handler(&leak);
+    }
+    mtx_unlock(&list->lock);
+}
+
+#define tce_malloc(size) __tce_malloc((size),__FILE__,__LINE__)
+#define tce_calloc(count,size) __tce_calloc((count),(size),__FILE__,__LINE__)
+#define tce_realloc(p,size) __tce_realloc((p),(size),__FILE__,__LINE__)
+#define tce_free(p) __tce_free(p)
+// Marks a block as owned by a cleanup, so an unwinding exception does not report it.
+#define tce_guard(p) __tce_guard_set((p),1)
+// Gives the block back to the leak check, e.g. once its cleanup no longer owns it.
+#define tce_unguard(p) __tce_guard_set((p),0)
+
+#define __EXP_LEAK_MARK() __e_frame.leak_mark = __tce_block_seq;
+#define __TCE_LEAK_UNWIND() __tce_leak_unwind(&__e_frame);
+#else
+#define tce_malloc(size) malloc(size)
+#define tce_calloc(count,size) calloc((count),(size))
+#define tce_realloc(p,size) realloc((p),(size))
+#define tce_free(p) free(p)
+#define tce_guard(p) ((void)(p))
+#define tce_unguard(p) ((void)(p))
+#define __EXP_LEAK_MARK()
+#define __TCE_LEAK_UNWIND()
+#endif // TCE_LEAK_CHECK
+
+/*
+* Catch-arm profiles (define TCE_PROFILE_ARMS before including this header).
+*
+*   Every Try site counts, for each of its Catch arms in order, how many exceptions tested the
+*   arm and how many it handled. At exit the counts are written to the file named by
+*   TCE_ARMS_OUT (tce_arms.prof by default). tools/tce_armorder.c turns the profile into a
+*   report of the chains worth reordering, or into TCE_CATCH_TABLE initializers listing the
+*   codes hottest first.
+*
+*   CatchTable keeps the codes of a table in move-to-front order instead: the code caught last
+*   is tested first, so a hot code costs one comparison wherever it was listed. The order is a
+*   permutation packed in one atomic word, and it's only written when the caught code was not
+*   already first.
+*/
+
+#define TCE_CATCH_TABLE_MAX 16      // Codes per table.
+
+// The codes of a CatchTable. Initialize it with TCE_CATCH_TABLE.
+typedef struct tce_catch_table_t{
+    int codes[TCE_CATCH_TABLE_MAX];
+    int count;
+    atomic_ullong order;            // Nibble k holds the index of the k-th code to test.
+} tce_catch_table;
+
+#define TCE_CATCH_TABLE(...) \
+    {.codes = {__VA_ARGS__},.count = (int)(sizeof((int[]){__VA_ARGS__}) / sizeof(int)),.order = 0xFEDCBA9876543210ull}
+
+static inline int __tce_table_match(tce_catch_table* t,int code){
+    unsigned long long order = atomic_load_explicit(&t->order,memory_order_relaxed);
+    for (int k = 0; k < t->count; ++k){
+        unsigned i = (unsigned)(order >> (4 * k)) & 15;
+        if (t->codes[i] != code) continue;
+        if (k){
+            // Move to front: entries 0 .. k-1 move up one, entry k becomes the first.
+            unsigned long long high = k == 15 ? 0 : order >> (4 * (k + 1)) << (4 * (k + 1));
+            unsigned long long low = order & ((1ull << (4 * k)) - 1);
+            atomic_compare_exchange_strong_explicit(&t->order,&order,high | low << 4 | i,memory_order_relaxed,memory_order_relaxed);
+        }
+        return 1;
+    }
+    return 0;
+}
+
+#ifdef TCE_PROFILE_ARMS
+
+#ifndef TCE_PROFILE_ARMS_MAX
+#define TCE_PROFILE_ARMS_MAX 16     // Arms counted per Try site. Later arms are not counted.
+#endif
+
+// The arm counters of one Try site.
+typedef struct __tce_arm_site_t{
+    const char* file;
+    int line;
+    const char* func;
+    atomic_ullong dispatches;       // Exceptions that reached the arms.
+    struct{
+        _Atomic(const char*) label; // NULL until the arm is first tested.
+        atomic_int line;
+        atomic_ullong tests;
+        atomic_ullong hits;
+    } arms[TCE_PROFILE_ARMS_MAX];
+    atomic_int registered;
+    struct __tce_arm_site_t* next;
+} __tce_arm_site;
+
+static _Atomic(__tce_arm_site*) __tce_arm_sites = NULL;
+static once_flag __tce_arm_sites_once = ONCE_FLAG_INIT;
+
+/**
+* @brief Writes the arm counters of every Try site that dispatched an exception so far.
+*        Fields are tab-separated: 'site file line func dispatches', then one
+*        'arm index line tests hits label' per arm.
+* @return 1 on success, 0 if the file cannot be written.
+*/
+static inline int tce_arms_write(const char* path){
+    FILE* f = fopen(path,"w");
+    if (!f) return 0;
+    fprintf(f,"# TinyCException arm profile. Turn it into a report with tools/tce_armorder.c.\n");
+    for (__tce_arm_site* s = atomic_load(&__tce_arm_sites); s; s = s->next){
+        fprintf(f,"site\t%s\t%d\t%s\t%llu\n",s->file,s->line,s->func,atomic_load_explicit(&s->dispatches,memory_order_relaxed));
+        for (int i = 0; i < TCE_PROFILE_ARMS_MAX; ++i){
+            const char* label = atomic_load_explicit(&s->arms[i].label,memory_order_acquire);
+            if (!label) break;
+            fprintf(f,"arm\t%d\t%d\t%llu\t%llu\t%s\n",i,atomic_load_explicit(&s->arms[i].line,memory_order_relaxed),
+                atomic_load_explicit(&s->arms[i].tests,memory_order_relaxed),atomic_load_explicit(&s->arms[i].hits,memory_order_relaxed),label);
+        }
+    }
+    return fclose(f) == 0;
+}
+
+static inline void __tce_arm_sites_at_exit(void){
+    const char* path = getenv("TCE_ARMS_OUT");
+    if (!path) path = "tce_arms.prof";
+    if (!tce_arms_write(path)) fprintf(stderr,"tce: cannot write the arm profile '%s'\n",path);
+}
+
+static inline void __tce_arm_sites_register(void){
+    atexit(__tce_arm_sites_at_exit);
+}
+
+// Counts the test of the next arm of a frame. Returns 'match'.
+static inline int __tce_arm_test(__tce_arm_site* site,__exp_frame* frame,const char* label,int line,const char* func,int match){
+    int i = frame->arm++;
+    if (i == 0){
+        atomic_fetch_add_explicit(&site->dispatches,1,memory_order_relaxed);
+        if (!atomic_load_explicit(&site->registered,memory_order_relaxed) && !atomic_exchange(&site->registered,1)){
+            call_once(&__tce_arm_sites_once,__tce_arm_sites_register);
+            site->func = func;
+            site->next = atomic_load(&__tce_arm_sites);
+            while (!atomic_compare_exchange_weak(&__tce_arm_sites,&site->next,site));
+        }
+    }
+    if (i < TCE_PROFILE_ARMS_MAX){
+        if (!atomic_load_explicit(&site->arms[i].label,memory_order_relaxed)){
+            atomic_store_explicit(&site->arms[i].line,line,memory_order_relaxed);
+            atomic_store_explicit(&site->arms[i].label,label,memory_order_release);
+        }
+        atomic_fetch_add_explicit(&site->arms[i].tests,1,memory_order_relaxed);
+        if (match) atomic_fetch_add_explicit(&site->arms[i].hits,1,memory_order_relaxed);
+    }
+    return match;
+}
+
+#define __EXP_ARM_SITE() static __tce_arm_site __e_arm_site = {.file = __FILE__,.line = __LINE__}; (void)__e_arm_site; /* Unused by a Try without Catch arms. */
+#define __EXP_ARM_RESET(frame) (frame)->arm = 0;
+#define __EXP_ARM(label,match) \
+    (((__e_frame.flag & 3) < 2) && __tce_arm_test(&__e_arm_site,&__e_frame,(label),__LINE__,__FUNCTION__,!!(match)))
+#else
+#define __EXP_ARM_SITE()
+#define __EXP_ARM_RESET(frame)
+#define __EXP_ARM(label,match) (((__e_frame.flag & 3) < 2) && (match))
+#endif // TCE_PROFILE_ARMS
+
+// Compilers with __builtin_setjmp/__builtin_longjmp on this target, used by TryFrequent frames.
+#if (defined(__GNUC__) && !defined(__clang__)) || (defined(__clang__) && (defined(__x86_64__) || defined(__i386__)))
+#define __EXP_BUILTIN_JMP
+#endif
+
 /**
 * @brief Internal function to handle the actual throwing logic.
 *        It's not meant to be called directly by the user.
@@ -83,28 +1434,73 @@ void __exp_throw_internal(int code){
     if (__exp_stack_top){
         // If we are inside a Try block, store the error code and jump.
         __exp_stack_top->error_code = code;
+        __EXP_ARM_RESET(__exp_stack_top)
+#ifdef __EXP_BUILTIN_JMP
+        // A TryFrequent frame (0x400) was saved with __builtin_setjmp.
+        if (__exp_stack_top->flag & 0x400) __builtin_longjmp((void**)__exp_stack_top->buf,1);
+#endif
         longjmp(__exp_stack_top->buf,1);
     } else{
+        __TCE_STATS_UNCAUGHT()
         // If a custom terminate handler is set, call it.
         if (__terminate_handle) __terminate_handle(code);
         // If no Try block is active and no custom handler is set (or it returns),
         // this is an uncaught exception. Print details and abort the program.
-        printf("\n--- UNCAUGHT EXCEPTION ---\nError Code: %d\nAt -> %s\nFunc -> %s\nLine -> %d\n--- PROGRAM WILL ABORT ---\n",
-            code,__exception_detail_s.file,__exception_detail_s.func,__exception_detail_s.line);
-        fflush(stdout);
-        abort();
+        __tce_abort_report("UNCAUGHT EXCEPTION",code);
     }
 }
 
-// Begins a protected block. Pushes a new exception frame onto the stack.
-#define Try \
-    do { \
+// Branch hints for the setjmp of a frame. 'rare' lays the handlers out as cold code.
+#if defined(__GNUC__) || defined(__clang__)
+#define __EXP_EXPECT_RARE(c) __builtin_expect(!!(c),1)
+#else
+#define __EXP_EXPECT_RARE(c) (c)
+#endif
+#define __EXP_EXPECT_NONE(c) (c)
+
+// Pushes a new exception frame onto the stack and opens its body.
+#define __EXP_TRY_FRAME(expect) __EXP_TRY_FRAME_AS(expect,0,setjmp(__e_frame.buf))
+
+// The same, with the initial flags of the frame and the call that saves its context.
+#define __EXP_TRY_FRAME_AS(expect,kind,save) \
         __exp_frame __e_frame; \
         __e_frame.prev = __exp_stack_top; \
         __exp_stack_top = &__e_frame; \
+        __EXP_PUSH_FRAME() \
+        __EXP_STACK_PROBE() \
+        __EXP_ARM_SITE() \
+        __EXP_LEAK_MARK() \
         __e_frame.error_code = 0; \
-        __e_frame.flag = 0; \
-        if (setjmp(__e_frame.buf) == 0) {
+        __e_frame.flag = (kind); \
+        __e_frame.end_hook = NULL; \
+        if (expect((save) == 0)) {
+
+// Begins a protected block. Pushes a new exception frame onto the stack.
+#define Try do { __EXP_TRY_FRAME(__EXP_EXPECT_NONE)
+
+// A Try for a site that almost never throws: the handlers are moved off the hot path.
+#define TryRare do { __EXP_TRY_FRAME(__EXP_EXPECT_RARE)
+
+// A Try for a site that throws often. Where the compiler has them, the frame is saved with
+// __builtin_setjmp and resumed with __builtin_longjmp: a few inline stores instead of a libc
+// call, and a jump without the pointer demangling and checks of longjmp. The enclosing
+// function saves its callee-saved registers once, in its prologue, in exchange. Neither path
+// is treated as cold. Elsewhere it's a plain Try.
+#ifdef __EXP_BUILTIN_JMP
+#define __EXP_TRY_FRAME_FREQUENT __EXP_TRY_FRAME_AS(__EXP_EXPECT_NONE,0x400,__builtin_setjmp((void**)__e_frame.buf))
+#else
+#define __EXP_TRY_FRAME_FREQUENT __EXP_TRY_FRAME(__EXP_EXPECT_NONE)
+#endif
+#define TryFrequent do { __EXP_TRY_FRAME_FREQUENT
+
+// A Try whose body is the call 'fn(ctx)'. The state the handlers need lives in '*ctx'
+// instead of in locals, so the body keeps its own locals in registers and needs no
+// 'volatile': its frame is gone when the handlers run. C11 7.13.2.1 still applies to the
+// function containing the TryFn: its non-volatile automatics changed after the Try starts
+// are indeterminate in the handlers. So '*ctx' must not be one of them: make it volatile,
+// or keep it static, on the heap or in a caller's frame.
+// Example: TryFn(st,parse_all) Catch(BadRow) { printf("row %d\n",st->row); } End;
+#define TryFn(ctx,fn) Try (fn)(ctx);
 
 // A convenience macro to access the current exception code within a CatchCustom block.
 #define ErrorCode __e_frame.error_code
@@ -115,51 +1511,859 @@ void __exp_throw_internal(int code){
 // It's recommended to use the 'ErrorCode' macro to access the thrown error code.
 // Example: CatchCustom(IS_FILE_ERROR(ErrorCode))
 #define CatchCustom(condition) \
-        } else if (((__e_frame.flag & 3) < 2) && (condition)) { \
+        } else if (__EXP_ARM("CatchCustom(" #condition ")",(condition))) { \
+            __TCE_STATS_CATCH() \
+            __exp_handle_begin(&__e_frame); \
             __e_frame.error_code = 0; /* Mark as handled */
 
 // Catches a specific exception by its error code.
 #define Catch(e) \
-        } else if (__e_frame.error_code == (e) && ((__e_frame.flag & 3) < 2)) { \
+        } else if (__EXP_ARM("Catch(" #e ")",__e_frame.error_code == (e))) { \
+            __TCE_STATS_CATCH() \
+            __exp_handle_begin(&__e_frame); \
             __e_frame.error_code = 0; /* Mark as handled */
 
 // Catches any remaining unhandled exceptions.
 #define CatchAll \
-        } else if((__e_frame.flag & 3) < 2){ \
+        } else if (__EXP_ARM("CatchAll",1)) { \
+            __TCE_STATS_CATCH() \
+            __exp_handle_begin(&__e_frame); \
+            __e_frame.error_code = 0; /* Mark as handled */
+
+// Catches the codes of a tce_catch_table, testing the most recently caught code first.
+// The arm reads the code with tce_current().code.
+// Example:
+//   static tce_catch_table arms = TCE_CATCH_TABLE(Timeout,BadRow,IoError);
+//   ... } CatchTable(&arms) { switch (tce_current().code) { ... } } End;
+#define CatchTable(t) \
+        } else if (__EXP_ARM("CatchTable(" #t ")",__tce_table_match((t),__e_frame.error_code))) { \
+            __TCE_STATS_CATCH() \
+            __exp_handle_begin(&__e_frame); \
             __e_frame.error_code = 0; /* Mark as handled */
 
 // Defines a block of code that will always execute, regardless of whether an exception was thrown.
 #define Finally \
         } \
+        if ((__e_frame.flag & 0x100) && __e_frame.end_hook) __exp_run_end_hook(&__e_frame); \
         if (!(__e_frame.flag & 4)) { \
             __e_frame.flag |= 4;
 
+// Runs the end hook of a frame once. The frame is still on top, so a Throw from the hook
+// is handled by the frame's own Catch arms.
+static inline void __exp_run_end_hook(__exp_frame* frame){
+    void (*hook)(__exp_frame*) = frame->end_hook;
+    frame->end_hook = NULL;
+    hook(frame);
+}
+
 // Ends the exception block. Pops the frame and re-throws if an error was not handled.
 #define End \
         } \
+        if (__e_frame.end_hook) __exp_run_end_hook(&__e_frame); \
+        __EXP_HANDLE_END() \
         __exp_stack_top = __e_frame.prev; \
+        __EXP_POP_FRAME() \
         if (__e_frame.error_code != 0) { \
            if (__exp_stack_top) ++__exp_stack_top->flag;\
+            __TCE_STATS_UNWIND() \
+            __TCE_LEAK_UNWIND() \
             __exp_throw_internal(__e_frame.error_code); \
         } \
     } while(0)
 
 // Throws an exception with a given error code.
 // It captures the file, function, and line number where the exception is thrown.
-#define Throw(e) \
+#define Throw(e) ThrowWith(e,NULL)
+
+// Throws an exception carrying a payload, which handlers read with tce_current().payload.
+// The payload must outlive the handlers, e.g. a static or thread-local object.
+#define ThrowWith(e,p) \
     do { \
-        __exception_detail_s.line = __LINE__; \
-        __exception_detail_s.file = __FILE__; \
-        __exception_detail_s.func = __FUNCTION__; \
+        int __exp_code = (e); \
+        __exp_detail_set(__FILE__,__FUNCTION__,__LINE__,(p)); \
+        __TCE_STATS_THROW(__exp_code) \
+        __TCE_POLICY_THROW(__exp_code) \
         if (__exp_stack_top) ++__exp_stack_top->flag;\
-        __exp_throw_internal(e); \
+        __exp_throw_internal(__exp_code); \
     } while(0)
 
+// Pops the current frame when leaving a Try block early. The end hook still runs.
+#define __EXP_LEAVE() \
+    __e_frame.flag |= 0x200; \
+    if (__e_frame.end_hook) __exp_run_end_hook(&__e_frame); \
+    __EXP_HANDLE_END() \
+    __exp_stack_top = __e_frame.prev; \
+    __EXP_POP_FRAME()
+
 // Special macros to exit from a Try block, bypassing Finally.
 // WARNING: These are for performance-critical paths. Manual resource cleanup is required.
-#define Return  {__exp_stack_top = __e_frame.prev;return;}
-#define ReturnV(v)   {__exp_stack_top = __e_frame.prev;return v;}
-#define Break    { __exp_stack_top = __e_frame.prev; break; }
-#define Continue { __exp_stack_top = __e_frame.prev; continue; }
+#define Return  {__EXP_LEAVE() return;}
+#define ReturnV(v)   {__EXP_LEAVE() return v;}
+#define Break    { __EXP_LEAVE() break; }
+#define Continue { __EXP_LEAVE() continue; }
+
+/*
+* Cancellation.
+*
+*   Work that may be abandoned binds a token to its thread and calls tce_checkpoint() at safe
+*   points. Once the token is cancelled, the next checkpoint throws TCE_CANCELLED, so the work
+*   unwinds through its own handlers instead of being killed.
+*/
+
+// A cancellation token. Zero-initialize it.
+typedef struct tce_cancel_t{
+    atomic_int cancelled;
+} tce_cancel;
+
+// The token checked by tce_checkpoint() on this thread, or NULL.
+thread_local static tce_cancel* __tce_cancel = NULL;
+
+/**
+* @brief Makes tce_checkpoint() on the calling thread check 'token' (NULL for none).
+* @return The token bound before.
+*/
+static inline tce_cancel* tce_cancel_bind(tce_cancel* token){
+    tce_cancel* prev = __tce_cancel;
+    __tce_cancel = token;
+    return prev;
+}
+
+// Cancels a token. Threads checking it throw TCE_CANCELLED at their next checkpoint.
+static inline void tce_cancel_request(tce_cancel* token){
+    atomic_store_explicit(&token->cancelled,1,memory_order_release);
+}
+
+// Returns 1 if the token of the calling thread was cancelled, or once per cancellation from the watchdog.
+static inline int tce_cancelled(void){
+    return (__tce_cancel && atomic_load_explicit(&__tce_cancel->cancelled,memory_order_acquire)) || __TCE_WATCH_CANCELLED();
+}
+
+// Throws TCE_CANCELLED if the token of the calling thread was cancelled.
+#define tce_checkpoint() do { if (tce_cancelled()) Throw(TCE_CANCELLED); } while(0)
+
+/*
+* Profile-guided Try sites.
+*
+*   TrySite(name) is a Try whose hint comes from a profile:
+*
+*     1. Build with TCE_PROFILE_SITES defined and run a representative workload. Every TrySite
+*        counts its entries and throws, and at exit the rates are written to the file named by
+*        TCE_PROFILE_OUT (tce_profile.h by default).
+*     2. Build with -DTCE_PROFILE='"tce_profile.h"', with the profile on the include path.
+*        Sites throwing less than TCE_PROFILE_RARE per mille become TryRare, sites throwing at
+*        least TCE_PROFILE_FREQUENT per mille become TryFrequent, and the other sites (or sites
+*        missing from the profile) stay plain Try.
+*
+*   Names must be valid identifiers. Sites sharing a name share a hint.
+*/
+
+#ifdef TCE_PROFILE
+#include TCE_PROFILE
+#endif
+
+// A profile entry is '#define TCE_SITE_<name> ~,TCE_HINT_RARE' (or TCE_HINT_FREQUENT).
+// The probe picks the token after the comma, or TCE_HINT_NONE if the site has no entry.
+#define __TCE_PROBE_SECOND(a,b,...) b
+#define __TCE_PROBE(...) __TCE_PROBE_SECOND(__VA_ARGS__,TCE_HINT_NONE,)
+#define __TCE_HINT_FRAME(hint) __TCE_HINT_FRAME_(hint)
+#define __TCE_HINT_FRAME_(hint) __EXP_FRAME_##hint
+#define __EXP_FRAME_TCE_HINT_NONE __EXP_TRY_FRAME(__EXP_EXPECT_NONE)
+#define __EXP_FRAME_TCE_HINT_RARE __EXP_TRY_FRAME(__EXP_EXPECT_RARE)
+#define __EXP_FRAME_TCE_HINT_FREQUENT __EXP_TRY_FRAME_FREQUENT
+#define __TCE_SITE_FRAME(name) __TCE_HINT_FRAME(__TCE_PROBE(TCE_SITE_##name))
+
+#ifdef TCE_PROFILE_SITES
+
+#ifndef TCE_PROFILE_RARE
+#define TCE_PROFILE_RARE 10         // Per mille of entries: below this a site is rare.
+#endif
+
+#ifndef TCE_PROFILE_FREQUENT
+#define TCE_PROFILE_FREQUENT 100    // Per mille of entries: from this a site is frequent.
+#endif
+
+#ifndef TCE_PROFILE_MIN_ENTRIES
+#define TCE_PROFILE_MIN_ENTRIES 100 // Sites entered fewer times get no hint.
+#endif
+
+// The counters of one TrySite.
+typedef struct __tce_site_t{
+    const char* name;
+    const char* file;
+    int line;
+    atomic_ullong entries;
+    atomic_ullong throws;
+    atomic_int registered;
+    struct __tce_site_t* next;
+} __tce_site;
+
+static _Atomic(__tce_site*) __tce_sites = NULL;
+static once_flag __tce_sites_once = ONCE_FLAG_INIT;
+
+/**
+* @brief Writes the throw rates of every TrySite entered so far as a profile header.
+* @return 1 on success, 0 if the file cannot be written.
+*/
+static inline int tce_profile_write(const char* path){
+    FILE* f = fopen(path,"w");
+    if (!f) return 0;
+    fprintf(f,"// Generated by a TCE_PROFILE_SITES build. Use it with -DTCE_PROFILE='\"%s\"'.\n",path);
+    for (__tce_site* s = atomic_load(&__tce_sites); s; s = s->next){
+        unsigned long long entries = 0, throws = 0;
+        __tce_site* first = atomic_load(&__tce_sites);
+        while (strcmp(first->name,s->name)) first = first->next;
+        if (first != s) continue;   // Already written with the first site of that name.
+        for (__tce_site* o = s; o; o = o->next){
+            if (strcmp(o->name,s->name)) continue;
+            entries += atomic_load_explicit(&o->entries,memory_order_relaxed);
+            throws += atomic_load_explicit(&o->throws,memory_order_relaxed);
+        }
+        fprintf(f,"// %s (%s:%d): %llu entries, %llu throws\n",s->name,s->file,s->line,entries,throws);
+        if (entries < TCE_PROFILE_MIN_ENTRIES) continue;
+        if (throws * 1000 < entries * TCE_PROFILE_RARE) fprintf(f,"#define TCE_SITE_%s ~,TCE_HINT_RARE\n",s->name);
+        else if (throws * 1000 >= entries * TCE_PROFILE_FREQUENT) fprintf(f,"#define TCE_SITE_%s ~,TCE_HINT_FREQUENT\n",s->name);
+    }
+    return fclose(f) == 0;
+}
+
+static inline void __tce_sites_at_exit(void){
+    const char* path = getenv("TCE_PROFILE_OUT");
+    if (!path) path = "tce_profile.h";
+    if (!tce_profile_write(path)) fprintf(stderr,"tce: cannot write the site profile '%s'\n",path);
+}
+
+static inline void __tce_sites_register(void){
+    atexit(__tce_sites_at_exit);
+}
+
+// End hook of a profiled TrySite.
+static inline void __tce_site_end(__exp_frame* frame){
+    __tce_site* site = (__tce_site*)frame->end_arg;
+    atomic_fetch_add_explicit(&site->entries,1,memory_order_relaxed);
+    if (frame->flag & 3) atomic_fetch_add_explicit(&site->throws,1,memory_order_relaxed);
+    if (!atomic_load_explicit(&site->registered,memory_order_relaxed) && !atomic_exchange(&site->registered,1)){
+        call_once(&__tce_sites_once,__tce_sites_register);
+        site->next = atomic_load(&__tce_sites);
+        while (!atomic_compare_exchange_weak(&__tce_sites,&site->next,site));
+    }
+}
+
+#define TrySite(site) \
+    do { \
+        static __tce_site __tce_site_rec = {.name = #site,.file = __FILE__,.line = __LINE__}; \
+        __TCE_SITE_FRAME(site) \
+        __e_frame.end_hook = __tce_site_end; \
+        __e_frame.end_arg = &__tce_site_rec;
+#else
+#define TrySite(name) do { __TCE_SITE_FRAME(name)
+#endif // TCE_PROFILE_SITES
+
+/*
+* Action policy (define TCE_ENABLE_POLICY before including this header).
+*
+*   Decides at runtime what happens when a code is thrown, without rebuilding:
+*
+*     TCE_POLICY="FileNotFound=log, 42=sample, domain:2=count, *=none" ./app
+*     TCE_POLICY=@/etc/app/tce.policy ./app      (the same rules, one or more per line)
+*
+*   Call tce_policy_load() at startup, and again whenever the rules should be reloaded.
+*   A key is a code, a catalog name, 'domain:N' (codes whose bits 16 and up are N) or '*'.
+*   Actions are none, log, sample, count and abort. A code rule beats a domain rule, which
+*   beats '*'. Codes below TCE_POLICY_CODES have their own entry; larger codes share the entry
+*   of their domain. The library's reserved codes (TCE_IO, TCE_CANCELLED...) have their own
+*   entries too, so 'TCE_IO=log' works; other negative codes share the '*' entry.
+*
+*   The rules are compiled into a flat table indexed by code, so a throw costs one load of the
+*   table pointer and one byte. Reloading swaps the pointer atomically, and readers never lock.
+*   Replaced tables are kept, not freed, since a thread may still be reading them.
+*/
+
+#ifdef TCE_ENABLE_POLICY
+
+#ifndef TCE_POLICY_CODES
+#define TCE_POLICY_CODES 1024       // Codes [0, TCE_POLICY_CODES) get an entry of their own.
+#endif
+
+#ifndef TCE_POLICY_DOMAINS
+#define TCE_POLICY_DOMAINS 256      // Domains with an entry of their own.
+#endif
+
+#ifndef TCE_POLICY_BUILTINS
+#define TCE_POLICY_BUILTINS 32      // Reserved codes, from TCE_AGGREGATE down, with an entry of their own.
+#endif
+
+#ifndef TCE_POLICY_SAMPLE
+#define TCE_POLICY_SAMPLE 64        // 'sample' reports one throw in TCE_POLICY_SAMPLE, per thread.
+#endif
+
+// Code entries, then domain entries, then the '*' entry, then the reserved code entries.
+#define __TCE_POLICY_ANY (TCE_POLICY_CODES + TCE_POLICY_DOMAINS)
+#define __TCE_POLICY_SLOTS (__TCE_POLICY_ANY + 1 + TCE_POLICY_BUILTINS)
+
+typedef struct __tce_policy_table_t{
+    _Alignas(64) unsigned char actions[__TCE_POLICY_SLOTS];
+    struct __tce_policy_table_t* retired;   // The table this one replaced.
+} __tce_policy_table;
+
+static _Atomic(__tce_policy_table*) __tce_policy = NULL;
+static atomic_ullong __tce_policy_counts[__TCE_POLICY_SLOTS];
+thread_local static unsigned __tce_policy_tick = 0;
+
+// The index of a reserved code among the built-in entries, or TCE_POLICY_BUILTINS or more.
+static inline unsigned __tce_policy_builtin(int code){
+    return (unsigned)TCE_AGGREGATE - (unsigned)code;
+}
+
+static inline unsigned __tce_policy_slot(int code){
+    unsigned u = (unsigned)code;
+    if (u < TCE_POLICY_CODES) return u;
+    if (code < 0){
+        u = __tce_policy_builtin(code);
+        return u < TCE_POLICY_BUILTINS ? __TCE_POLICY_ANY + 1 + u : __TCE_POLICY_ANY;
+    }
+    u >>= 16;
+    return TCE_POLICY_CODES + (u < TCE_POLICY_DOMAINS ? u : TCE_POLICY_DOMAINS);
+}
+
+static const char* const __tce_policy_names[] = {"none","log","sample","count","abort"};
+
+/**
+* @brief Returns the action the loaded policy takes for a code (TCE_ACTION_*).
+*/
+static inline int tce_policy_action(int code){
+    __tce_policy_table* t = atomic_load_explicit(&__tce_policy,memory_order_acquire);
+    return t ? t->actions[__tce_policy_slot(code)] : TCE_ACTION_NONE;
+}
+
+/**
+* @brief Returns how many throws the policy acted on in the entry of a code.
+*        Codes sharing a domain or the '*' entry share the count.
+*/
+static inline unsigned long long tce_policy_count(int code){
+    return atomic_load_explicit(&__tce_policy_counts[__tce_policy_slot(code)],memory_order_relaxed);
+}
+
+static inline void __tce_policy_act(int action,unsigned slot,int code){
+    atomic_fetch_add_explicit(&__tce_policy_counts[slot],1,memory_order_relaxed);
+    if (action == TCE_ACTION_COUNT) return;
+    if (action == TCE_ACTION_ABORT) __tce_abort_report("EXCEPTION ESCALATED BY POLICY",code);
+    if (action == TCE_ACTION_SAMPLE && __tce_policy_tick++ % TCE_POLICY_SAMPLE) return;
+    fprintf(stderr,"tce: %s %d (%s) at %s:%d in %s\n",action == TCE_ACTION_SAMPLE ? "sampled" : "thrown",
+        code,tce_strerror(code),__exception_detail_s.file,__exception_detail_s.line,__exception_detail_s.func);
+}
+
+static inline void __tce_policy_throw(int code){
+    __tce_policy_table* t = atomic_load_explicit(&__tce_policy,memory_order_acquire);
+    if (t){
+        unsigned slot = __tce_policy_slot(code);
+        if (t->actions[slot]) __tce_policy_act(t->actions[slot],slot,code);
+    }
+}
+
+static inline void __tce_policy_report(int code){
+    int action = tce_policy_action(code);
+    if (action != TCE_ACTION_NONE) printf("Policy -> %s (%llu throws)\n",__tce_policy_names[action],tce_policy_count(code));
+}
+
+static inline void __tce_policy_bad_rule(const char* rule,int len){
+    fprintf(stderr,"tce: bad policy rule '%.*s'\n",len,rule);
+    Throw(TCE_BAD_POLICY);
+}
+
+/**
+* @brief Compiles policy rules and installs them, replacing the current policy.
+*        Rules are separated by commas, semicolons or whitespace; '#' starts a comment.
+*        Throws TCE_BAD_POLICY on an invalid rule, leaving the current policy in place.
+*/
+static inline void tce_policy_parse(const char* text){
+    signed char code_rule[TCE_POLICY_CODES], domain_rule[TCE_POLICY_DOMAINS], builtin_rule[TCE_POLICY_BUILTINS];
+    int fallback = TCE_ACTION_NONE;
+    __tce_policy_table* t;
+    memset(code_rule,-1,sizeof(code_rule));
+    memset(domain_rule,-1,sizeof(domain_rule));
+    memset(builtin_rule,-1,sizeof(builtin_rule));
+    while (*text){
+        const char *rule, *eq, *end;
+        int action = -1, len;
+        if (*text == '#'){
+            while (*text && *text != '\n') ++text;
+            continue;
+        }
+        if (*text == ',' || *text == ';' || isspace((unsigned char)*text)){
+            ++text;
+            continue;
+        }
+        rule = text;
+        while (*text && *text != ',' && *text != ';' && *text != '#' && !isspace((unsigned char)*text)) ++text;
+        end = text;
+        len = (int)(end - rule);
+        for (eq = rule; eq < end && *eq != '='; ++eq);
+        if (eq == end || eq == rule) __tce_policy_bad_rule(rule,len);
+        for (int a = 0; a < (int)(sizeof(__tce_policy_names) / sizeof(__tce_policy_names[0])); ++a)
+            if ((size_t)(end - eq - 1) == strlen(__tce_policy_names[a]) && !strncmp(eq + 1,__tce_policy_names[a],(size_t)(end - eq - 1))) action = a;
+        if (action < 0) __tce_policy_bad_rule(rule,len);
+        if (eq - rule == 1 && *rule == '*'){
+            fallback = action;
+        } else if (eq - rule > 7 && !strncmp(rule,"domain:",7)){
+            char* num_end;
+            unsigned long d = strtoul(rule + 7,&num_end,10);
+            if (num_end != eq || d >= TCE_POLICY_DOMAINS) __tce_policy_bad_rule(rule,len);
+            domain_rule[d] = (signed char)action;
+        } else{
+            char* num_end;
+            long code = strtol(rule,&num_end,10);
+            if (num_end != eq){
+                // Not a number: look the name up in the catalog.
+                size_t i = 0;
+                while (i < __TCE_CATALOG_SIZE && (strlen(__tce_catalog[i].name) != (size_t)(eq - rule) ||
+                    strncmp(__tce_catalog[i].name,rule,(size_t)(eq - rule)))) ++i;
+                if (i == __TCE_CATALOG_SIZE) __tce_policy_bad_rule(rule,len);
+                code = __tce_catalog[i].code;
+            }
+            if (code <= TCE_AGGREGATE && code > (long)TCE_AGGREGATE - TCE_POLICY_BUILTINS)
+                builtin_rule[TCE_AGGREGATE - code] = (signed char)action;
+            else if (code < 0 || code >= TCE_POLICY_CODES) __tce_policy_bad_rule(rule,len);
+            else code_rule[code] = (signed char)action;
+        }
+    }
+    if (!(t = (__tce_policy_table*)aligned_alloc(_Alignof(__tce_policy_table),sizeof(__tce_policy_table)))) abort();
+    t->actions[__TCE_POLICY_ANY] = (unsigned char)fallback;
+    for (int b = 0; b < TCE_POLICY_BUILTINS; ++b)
+        t->actions[__TCE_POLICY_ANY + 1 + b] = (unsigned char)(builtin_rule[b] >= 0 ? builtin_rule[b] : fallback);
+    for (int d = 0; d < TCE_POLICY_DOMAINS; ++d)
+        t->actions[TCE_POLICY_CODES + d] = (unsigned char)(domain_rule[d] >= 0 ? domain_rule[d] : fallback);
+    for (int c = 0; c < TCE_POLICY_CODES; ++c)
+        t->actions[c] = (unsigned char)(code_rule[c] >= 0 ? code_rule[c] : t->actions[TCE_POLICY_CODES]);
+    t->retired = atomic_exchange_explicit(&__tce_policy,t,memory_order_acq_rel);
+}
+
+/**
+* @brief Loads policy rules from a file and installs them.
+*        Throws TCE_BAD_POLICY if the file cannot be read or holds an invalid rule.
+*/
+static inline void tce_policy_load_file(const char* path){
+    FILE* f = fopen(path,"rb");
+    char* text = NULL;
+    long size;
+    if (!f){
+        fprintf(stderr,"tce: cannot open policy file '%s'\n",path);
+        Throw(TCE_BAD_POLICY);
+    }
+    if (fseek(f,0,SEEK_END) || (size = ftell(f)) < 0 || fseek(f,0,SEEK_SET) ||
+        !(text = (char*)malloc((size_t)size + 1)) || fread(text,1,(size_t)size,f) != (size_t)size){
+        fclose(f);
+        free(text);
+        fprintf(stderr,"tce: cannot read policy file '%s'\n",path);
+        Throw(TCE_BAD_POLICY);
+    }
+    fclose(f);
+    text[size] = '\0';
+    Try {
+        tce_policy_parse(text);
+    } Finally {
+        free(text);
+    } End;
+}
+
+/**
+* @brief Loads the policy named by the TCE_POLICY environment variable: rules, or '@' and a file.
+* @return 1 if a policy was installed, 0 if TCE_POLICY is not set.
+*/
+static inline int tce_policy_load(void){
+    const char* env = getenv("TCE_POLICY");
+    if (!env) return 0;
+    if (*env == '@') tce_policy_load_file(env + 1);
+    else tce_policy_parse(env);
+    return 1;
+}
+
+#endif // TCE_ENABLE_POLICY
+
+/*
+* Aggregate exceptions.
+*
+* SYNTAX:
+*   TryCollect {
+*       for (long i = 0; i < n; ++i)
+*           if (!valid(&records[i])) ThrowCollect(InvalidRecord,i);   // Records and keeps going.
+*   } Catch(TCE_AGGREGATE) {
+*       tce_collect_iter it = tce_collect_iterate(tce_aggregate());
+*       const tce_collected* e;
+*       while ((e = tce_collect_next(&it))) printf("%ld: %d\n",e->index,e->code);
+*   } End;
+*
+* NOTES:
+*   - When the body completes without throwing and errors were collected, a single TCE_AGGREGATE
+*     is thrown, before 'Finally', so the block's own arms handle it and 'Finally' runs last as
+*     in any Try. Its site is the site of the first collected error.
+*   - Leaving the block with 'Return', 'Break' or 'Continue' drops the collected errors.
+*   - Outside of a 'TryCollect' block, 'ThrowCollect' behaves like 'Throw'.
+*   - Worker threads append to a collector with tce_collect_join(set), each into its own slot,
+*     without locks. They must call tce_collect_leave() and be joined before the block ends.
+*   - Collected errors live in a per-thread arena. They stay valid until this thread starts
+*     its next outermost 'TryCollect'.
+*/
+
+#ifndef TCE_COLLECT_CHUNK
+#define TCE_COLLECT_CHUNK 64    // Errors per arena chunk.
+#endif
+
+#ifndef TCE_COLLECT_SLOTS
+#define TCE_COLLECT_SLOTS 64    // Threads that can append to one collector (the owner included).
+#endif
+
+// One collected error.
+typedef struct tce_collected_t{
+    int code;
+    long index;                  // The index passed to ThrowCollect, e.g. the failing record.
+    const char* file;
+    const char* func;
+    int line;
+} tce_collected;
+
+typedef struct __tce_collect_chunk_t{
+    struct __tce_collect_chunk_t* next;
+    int count;
+    tce_collected items[TCE_COLLECT_CHUNK];
+} __tce_collect_chunk;
+
+// The errors appended by one thread. Only that thread writes to it.
+typedef struct __tce_collect_slot_t{
+    __tce_collect_chunk* head;
+    __tce_collect_chunk* tail;
+    long count;
+} __tce_collect_slot;
+
+// The errors collected by one 'TryCollect' block.
+typedef struct tce_errset_t{
+    struct tce_errset_t* prev;        // The enclosing collector on the owner thread.
+    __tce_collect_slot* prev_slot;    // Where the owner appended before this block.
+    struct tce_errset_t* arena_next;  // Link in the owner's arena.
+    atomic_int nslots;                // Slots claimed so far. Slot 0 is the owner's.
+    __tce_collect_slot slots[TCE_COLLECT_SLOTS];
+} tce_errset;
+
+// The per-thread collector state and arena.
+thread_local static struct{
+    tce_errset* current;              // The innermost active collector of this thread.
+    __tce_collect_slot* slot;         // Where ThrowCollect appends, NULL if not collecting.
+    tce_errset* used;                 // Sets handed out since the last reset.
+    tce_errset* free_sets;
+    __tce_collect_chunk* free_chunks;
+    const tce_errset* last;           // The set behind the last TCE_AGGREGATE thrown here.
+} __tce_collect = {0,0,0,0,0,0};
+
+// Returns every set and chunk handed out by this thread's arena to its free lists.
+static inline void __tce_collect_reset(void){
+    tce_errset* set = __tce_collect.used;
+    while (set){
+        tce_errset* next = set->arena_next;
+        int nslots = atomic_load(&set->nslots);
+        if (nslots > TCE_COLLECT_SLOTS) nslots = TCE_COLLECT_SLOTS;
+        for (int i = 0; i < nslots; ++i){
+            if (set->slots[i].tail){
+                set->slots[i].tail->next = __tce_collect.free_chunks;
+                __tce_collect.free_chunks = set->slots[i].head;
+            }
+        }
+        set->arena_next = __tce_collect.free_sets;
+        __tce_collect.free_sets = set;
+        set = next;
+    }
+    __tce_collect.used = NULL;
+    __tce_collect.last = NULL;
+}
+
+static inline void __tce_collect_slot_init(__tce_collect_slot* slot){
+    slot->head = slot->tail = NULL;
+    slot->count = 0;
+}
+
+static inline __tce_collect_chunk* __tce_collect_grow(__tce_collect_slot* slot){
+    __tce_collect_chunk* chunk = __tce_collect.free_chunks;
+    if (chunk) __tce_collect.free_chunks = chunk->next;
+    else if (!(chunk = (__tce_collect_chunk*)malloc(sizeof(__tce_collect_chunk)))) abort();
+    chunk->next = NULL;
+    chunk->count = 0;
+    if (slot->tail) slot->tail->next = chunk; else slot->head = chunk;
+    slot->tail = chunk;
+    return chunk;
+}
+
+static inline void __tce_collect_end(__exp_frame* frame){
+    tce_errset* set = (tce_errset*)frame->end_arg;
+    __tce_collect.current = set->prev;
+    __tce_collect.slot = set->prev_slot;
+    // Only a block that ran to completion throws the aggregate; any other exception takes precedence,
+    // and a block left early with Return, Break or Continue drops its errors.
+    if ((frame->flag & 3) == 0 && !(frame->flag & 0x200)){
+        int nslots = atomic_load(&set->nslots);
+        if (nslots > TCE_COLLECT_SLOTS) nslots = TCE_COLLECT_SLOTS;
+        for (int i = 0; i < nslots; ++i){
+            if (set->slots[i].count){
+                const tce_collected* first = &set->slots[i].head->items[0];
+                __tce_collect.last = set;
+                __exp_detail_set(first->file,first->func,first->line,set);
+                __TCE_STATS_THROW(TCE_AGGREGATE)
+                __TCE_POLICY_THROW(TCE_AGGREGATE)
+                ++frame->flag;
+                __exp_throw_internal(TCE_AGGREGATE);
+            }
+        }
+    }
+}
+
+static inline void __tce_collect_begin(__exp_frame* frame){
+    tce_errset* set;
+    // The outermost collector recycles the arena.
+    if (!__tce_collect.current) __tce_collect_reset();
+    set = __tce_collect.free_sets;
+    if (set) __tce_collect.free_sets = set->arena_next;
+    else if (!(set = (tce_errset*)malloc(sizeof(tce_errset)))) abort();
+    set->arena_next = __tce_collect.used;
+    __tce_collect.used = set;
+    set->prev = __tce_collect.current;
+    set->prev_slot = __tce_collect.slot;
+    atomic_init(&set->nslots,1);
+    __tce_collect_slot_init(&set->slots[0]);
+    __tce_collect.current = set;
+    __tce_collect.slot = &set->slots[0];
+    frame->end_hook = __tce_collect_end;
+    frame->end_arg = set;
+    frame->flag |= 0x100;       // Throw the aggregate before 'Finally', so it runs after the arms.
+}
+
+static inline void __tce_collect_append(int code,long index,const char* file,const char* func,int line){
+    __tce_collect_slot* slot = __tce_collect.slot;
+    __tce_collect_chunk* chunk;
+    tce_collected* e;
+    if (!slot){
+        __exp_detail_set(file,func,line,NULL);
+        __TCE_STATS_THROW(code)
+        __TCE_POLICY_THROW(code)
+        if (__exp_stack_top) ++__exp_stack_top->flag;
+        __exp_throw_internal(code);
+    }
+    chunk = slot->tail;
+    if (!chunk || chunk->count == TCE_COLLECT_CHUNK) chunk = __tce_collect_grow(slot);
+    e = &chunk->items[chunk->count++];
+    e->code = code;
+    e->index = index;
+    e->file = file;
+    e->func = func;
+    e->line = line;
+    ++slot->count;
+}
+
+// Begins a block that collects errors and throws a single TCE_AGGREGATE at 'End'.
+#define TryCollect Try __tce_collect_begin(&__e_frame);
+
+// Records an error with the index of the failing item and continues.
+#define ThrowCollect(e,index) __tce_collect_append((e),(index),__FILE__,__FUNCTION__,__LINE__)
+
+// Returns the collector of the innermost active 'TryCollect' block, to hand to worker threads.
+static inline tce_errset* tce_collect_current(void){
+    return __tce_collect.current;
+}
+
+/**
+* @brief Makes 'ThrowCollect' on the calling thread append to 'set', in a slot of its own.
+* @return 1 on success, 0 if all slots are taken ('ThrowCollect' then behaves like 'Throw').
+*/
+static inline int tce_collect_join(tce_errset* set){
+    int i = atomic_fetch_add(&set->nslots,1);
+    if (i >= TCE_COLLECT_SLOTS) return 0;
+    __tce_collect_slot_init(&set->slots[i]);
+    __tce_collect.slot = &set->slots[i];
+    return 1;
+}
+
+// Stops appending to the collector joined with tce_collect_join.
+static inline void tce_collect_leave(void){
+    __tce_collect.slot = NULL;
+}
+
+// Returns the set behind the last TCE_AGGREGATE thrown on this thread, or NULL.
+static inline const tce_errset* tce_aggregate(void){
+    return __tce_collect.last;
+}
+
+// Iterates the errors of a set, slot by slot in the order they were appended.
+typedef struct tce_collect_iter_t{
+    const tce_errset* set;
+    int slot;
+    const __tce_collect_chunk* chunk;
+    int pos;
+} tce_collect_iter;
+
+static inline tce_collect_iter tce_collect_iterate(const tce_errset* set){
+    tce_collect_iter it = {set,0,set ? set->slots[0].head : NULL,0};
+    return it;
+}
+
+static inline const tce_collected* tce_collect_next(tce_collect_iter* it){
+    int nslots;
+    if (!it->set) return NULL;
+    nslots = atomic_load(&it->set->nslots);
+    if (nslots > TCE_COLLECT_SLOTS) nslots = TCE_COLLECT_SLOTS;
+    while (!it->chunk || it->pos >= it->chunk->count){
+        if (it->chunk && it->chunk->next){
+            it->chunk = it->chunk->next;
+        } else{
+            if (++it->slot >= nslots) return NULL;
+            it->chunk = it->set->slots[it->slot].head;
+        }
+        it->pos = 0;
+    }
+    return &it->chunk->items[it->pos++];
+}
+
+// Returns the number of errors in a set.
+static inline long tce_collect_count(const tce_errset* set){
+    long count = 0;
+    int nslots;
+    if (!set) return 0;
+    nslots = atomic_load(&set->nslots);
+    if (nslots > TCE_COLLECT_SLOTS) nslots = TCE_COLLECT_SLOTS;
+    for (int i = 0; i < nslots; ++i) count += set->slots[i].count;
+    return count;
+}
+
+// Lists the collected errors in the uncaught exception report.
+static inline void __tce_collect_report(int code){
+    tce_collect_iter it;
+    const tce_collected* e;
+    int shown = 0;
+    if (code != TCE_AGGREGATE || !__tce_collect.last) return;
+    printf("Collected -> %ld error(s)\n",tce_collect_count(__tce_collect.last));
+    it = tce_collect_iterate(__tce_collect.last);
+    while ((e = tce_collect_next(&it)) && shown++ < 8){
+        const char* name = tce_errname(e->code);
+        printf("  [%ld] Error Code: %d%s%s%s at %s:%d\n",e->index,e->code,
+            name ? " (" : "",name ? name : "",name ? ")" : "",e->file,e->line);
+    }
+}
+
+// An exception captured where it was caught, so it can be re-thrown later, possibly on another thread.
+typedef struct tce_captured_t{
+    int code;          // The exception code, 0 if nothing was captured.
+    const char* file;  // Where the exception was originally thrown.
+    const char* func;
+    int line;
+    tce_scope scope;   // The request and tenant the exception was thrown for.
+    void* payload;
+    int cause;
+} tce_captured;
+
+/**
+* @brief Records an exception code together with the site of the throw being handled on this thread.
+*        Typically called from a CatchCustom condition: CatchCustom(tce_capture(&c,ErrorCode)).
+* @return 1, so it can be used directly as a catch condition.
+*/
+static inline int tce_capture(tce_captured* c,int code){
+    c->code = code;
+    c->file = __exception_detail_s.file;
+    c->func = __exception_detail_s.func;
+    c->line = __exception_detail_s.line;
+    c->scope = __exception_detail_s.scope;
+    c->payload = __exception_detail_s.payload;
+    c->cause = __exception_detail_s.cause;
+    return 1;
+}
+
+/**
+* @brief Re-throws a captured exception, reporting the site where it was originally thrown.
+*/
+static inline void tce_rethrow(const tce_captured* c){
+    __exception_detail_s.line = c->line;
+    __exception_detail_s.file = c->file;
+    __exception_detail_s.func = c->func;
+    __exception_detail_s.scope = c->scope;
+    __exception_detail_s.payload = c->payload;
+    __exception_detail_s.cause = c->cause;
+    if (__exp_stack_top) ++__exp_stack_top->flag;
+    __exp_throw_internal(c->code);
+}
+
+/*
+* Stackless coroutines (Duff's device).
+*
+* SYNTAX:
+*   typedef struct { tce_co co; int i; } counter;   // 'tce_co' must be the first member.
+*
+*   int count_to_3(tce_co* co){
+*       counter* self = (counter*)co;
+*       TCE_CO_BEGIN(co);
+*       for (self->i = 1; self->i <= 3; ++self->i) {
+*           if (self->i == 2 && fail) Throw(BadStep);
+*           TCE_CO_YIELD(co);
+*       }
+*       TCE_CO_END(co);
+*   }
+*
+*   counter c = {TCE_CO_INIT};
+*   while (tce_co_resume(&c.co,count_to_3)) printf("%d\n",c.i);
+*   TCE_CO_RETHROW(&c.co);   // Or inspect c.co.error and route it elsewhere.
+*
+* NOTES:
+*   - Locals of the coroutine function do not survive a yield; keep state in the struct.
+*   - Do not 'TCE_CO_YIELD' inside a 'Try' block: the frame would be left on the stack.
+*   - A yield's resume point is its __LINE__, so put at most one TCE_CO_YIELD on a line
+*     (two on one line are a duplicate case label, and do not compile).
+*   - An exception thrown while the coroutine runs is captured at the resume boundary with
+*     its throw site, payload and cause, stored in 'error', and the coroutine is finished.
+*     TCE_CO_RETHROW re-throws it with its original site.
+*/
+
+// The state of a stackless coroutine. Only a resume point and a pending exception.
+typedef struct tce_co_t{
+    int state;           // Resume point (a __LINE__ value). 0 = not started, -1 = finished.
+    tce_captured error;  // Exception captured at the resume boundary, error.code == 0 if none is pending.
+} tce_co;
+
+#define TCE_CO_INIT {0,{0}}
+
+// Opens the body of a coroutine function 'int fn(tce_co* co)'.
+#define TCE_CO_BEGIN(co) switch((co)->state){ case 0:
+
+// Suspends the coroutine. The next 'tce_co_resume' continues right after it.
+#define TCE_CO_YIELD(co) \
+    do { \
+        (co)->state = __LINE__; \
+        return 1; \
+        case __LINE__:; \
+    } while(0)
+
+// Closes the body of a coroutine function and marks it finished.
+#define TCE_CO_END(co) } (co)->state = -1; return 0
+
+/**
+* @brief Runs a coroutine until its next yield or its end.
+*        An exception escaping the coroutine is stored in 'co->error' instead of propagating.
+* @param co The coroutine state.
+* @param fn The coroutine function, built with TCE_CO_BEGIN / TCE_CO_YIELD / TCE_CO_END.
+* @return 1 if the coroutine yielded, 0 if it finished (normally or with a pending exception).
+*/
+static inline int tce_co_resume(tce_co* co,int (*fn)(tce_co*)){
+    volatile int yielded = 0;
+    if (co->state < 0) return 0;
+    Try {
+        yielded = fn(co);
+    } CatchCustom(tce_capture(&co->error,ErrorCode)) {
+        co->state = -1;
+    } End;
+    return yielded;
+}
+
+// Re-throws the pending exception of a coroutine, if any, from the driver's scope.
+// It keeps the site where it was originally thrown, its payload and its cause.
+#define TCE_CO_RETHROW(co) \
+    do { \
+        tce_captured __co_error = (co)->error; \
+        if (__co_error.code) { \
+            (co)->error.code = 0; \
+            tce_rethrow(&__co_error); \
+        } \
+    } while(0)
 
 #endif // !__TINY_C_EXCEPTION_H
\ No newline at end of file
@@ -0,0 +1,154 @@
+#ifndef __TINY_C_EXCEPTION_BULKHEAD_H
+#define __TINY_C_EXCEPTION_BULKHEAD_H
+
+#include "TinyCException.h"
+#include <time.h>
+
+/*
+* TinyCException Bulkhead - A concurrency limiter that throws TCE_REJECTED when it's full.
+*
+* SYNTAX:
+*   static tce_bulkhead db;
+*   tce_bulkhead_init(&db,32,0,0);           // At most 32 threads inside, no wait queue.
+*
+*   TryBulkhead(&db) {
+*       query(conn);                         // The slot is released at 'End', even when unwinding.
+*   } Catch(TCE_REJECTED) {
+*       reply_busy(conn);
+*   } End;
+*
+* NOTES:
+*   - A slot is taken with a single atomic fetch-add. A thread finding every slot taken is
+*     rejected at once, unless the bulkhead has a wait queue with a free place: it then waits up
+*     to 'wait_ms' for a slot and is rejected if none frees up.
+*   - Without a queue, taking and releasing slots is lock-free. With one, the mutex is only
+*     taken when a slot is handed over to a waiter, or a waiter gives up.
+*   - The rejection is thrown inside the block, so its own arms can handle TCE_REJECTED.
+*     'Return', 'Break' and 'Continue' release the slot too.
+*/
+
+typedef struct tce_bulkhead_t{
+    _Alignas(64) atomic_int inflight;   // Slot holders, waiters, and waiters that gave up.
+    int limit;
+    int queue;
+    unsigned wait_ms;
+    atomic_ullong rejected;
+    mtx_t lock;
+    cnd_t freed;
+    int permits;                        // Slots handed over to waiters, not yet taken.
+    int abandoned;                      // Waiters that gave up, still counted in 'inflight'.
+} tce_bulkhead;
+
+/**
+* @brief Initializes a bulkhead.
+* @param limit The number of threads allowed inside at once.
+* @param queue The number of threads that may wait for a slot (0 to reject at once).
+* @param wait_ms How long a queued thread waits before it's rejected.
+*/
+static inline void tce_bulkhead_init(tce_bulkhead* b,int limit,int queue,unsigned wait_ms){
+    atomic_init(&b->inflight,0);
+    b->limit = limit;
+    b->queue = queue;
+    b->wait_ms = wait_ms;
+    atomic_init(&b->rejected,0);
+    mtx_init(&b->lock,mtx_plain);
+    cnd_init(&b->freed);
+    b->permits = 0;
+    b->abandoned = 0;
+}
+
+static inline void tce_bulkhead_destroy(tce_bulkhead* b){
+    mtx_destroy(&b->lock);
+    cnd_destroy(&b->freed);
+}
+
+// Returns the number of threads holding or waiting for a slot.
+static inline int tce_bulkhead_inflight(tce_bulkhead* b){
+    int n = atomic_load_explicit(&b->inflight,memory_order_relaxed);
+    return n < 0 ? 0 : n;
+}
+
+// Returns the number of rejections so far.
+static inline unsigned long long tce_bulkhead_rejected(tce_bulkhead* b){
+    return atomic_load_explicit(&b->rejected,memory_order_relaxed);
+}
+
+// Releases a slot. If a thread is queued, the slot is handed over to it.
+static inline void tce_bulkhead_release(tce_bulkhead* b){
+    for (;;){
+        if (atomic_fetch_sub_explicit(&b->inflight,1,memory_order_release) <= b->limit) return;
+        mtx_lock(&b->lock);
+        if (b->abandoned){
+            // A waiter gave up: drop its ticket as well, and look for the next waiter.
+            --b->abandoned;
+            mtx_unlock(&b->lock);
+            continue;
+        }
+        ++b->permits;
+        cnd_signal(&b->freed);
+        mtx_unlock(&b->lock);
+        return;
+    }
+}
+
+// Waits for a slot to be handed over. Returns 0 if the wait timed out.
+static inline int __tce_bulkhead_wait(tce_bulkhead* b){
+    struct timespec deadline;
+    timespec_get(&deadline,TIME_UTC);
+    deadline.tv_sec += (time_t)(b->wait_ms / 1000);
+    deadline.tv_nsec += (long)(b->wait_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L){
+        deadline.tv_nsec -= 1000000000L;
+        ++deadline.tv_sec;
+    }
+    mtx_lock(&b->lock);
+    while (!b->permits && cnd_timedwait(&b->freed,&b->lock,&deadline) != thrd_timedout);
+    if (b->permits){
+        --b->permits;
+        mtx_unlock(&b->lock);
+        return 1;
+    }
+    // The ticket stays counted until a release drops it, so no slot is handed to nobody.
+    ++b->abandoned;
+    mtx_unlock(&b->lock);
+    return 0;
+}
+
+/**
+* @brief Takes a slot, waiting in the queue if the bulkhead has one.
+* @return 1 if a slot was taken, 0 if the bulkhead is full.
+*/
+static inline int tce_bulkhead_try_acquire(tce_bulkhead* b){
+    int n = atomic_fetch_add_explicit(&b->inflight,1,memory_order_acquire);
+    if (n < b->limit) return 1;
+    if (b->queue){
+        if (n < b->limit + b->queue && __tce_bulkhead_wait(b)) return 1;
+        if (n >= b->limit + b->queue){
+            // Over the queue: give the ticket up like a waiter would.
+            mtx_lock(&b->lock);
+            ++b->abandoned;
+            mtx_unlock(&b->lock);
+        }
+    } else atomic_fetch_sub_explicit(&b->inflight,1,memory_order_relaxed);
+    atomic_fetch_add_explicit(&b->rejected,1,memory_order_relaxed);
+    return 0;
+}
+
+// End hook of a TryBulkhead frame.
+static inline void __tce_bulkhead_end(__exp_frame* frame){
+    tce_bulkhead_release((tce_bulkhead*)frame->end_arg);
+}
+
+// Takes a slot for a frame, which releases it at 'End'. Returns 0 if the bulkhead is full.
+static inline int __tce_bulkhead_enter(__exp_frame* frame,tce_bulkhead* b){
+    if (!tce_bulkhead_try_acquire(b)) return 0;
+    frame->end_hook = __tce_bulkhead_end;
+    frame->end_arg = b;
+    return 1;
+}
+
+// Begins a block that holds a slot of the bulkhead 'b' until its 'End'.
+// The rejection is thrown from the block's own site.
+#define TryBulkhead(b) Try if (!__tce_bulkhead_enter(&__e_frame,(b))) Throw(TCE_REJECTED);
+
+#endif // !__TINY_C_EXCEPTION_BULKHEAD_H
\ No newline at end of file
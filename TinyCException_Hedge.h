@@ -0,0 +1,233 @@
+#ifndef __TINY_C_EXCEPTION_HEDGE_H
+#define __TINY_C_EXCEPTION_HEDGE_H
+
+#include "TinyCException.h"
+#include <time.h>
+
+/*
+* TinyCException Hedge - Hedged execution: alternatives race, the first success wins.
+*
+* SYNTAX:
+*   static void* from_cache(void* key){ ... tce_checkpoint(); ... }     // May Throw.
+*   static void* from_replica(void* key){ ... tce_checkpoint(); ... }
+*
+*   tce_hedge_fn alts[] = {from_cache,from_replica};
+*   Try {
+*       row = tce_hedged(2000,alts,2,key,free);   // from_replica starts if from_cache takes over 2 ms.
+*   } Catch(TCE_AGGREGATE) {
+*       tce_collect_iter it = tce_collect_iterate(tce_aggregate());
+*       const tce_collected* e;
+*       while ((e = tce_collect_next(&it))) printf("alternative %ld: %s\n",e->index,tce_strerror(e->code));
+*   } End;
+*
+* NOTES:
+*   - Every alternative runs on a worker thread. The next one starts when the delay passes
+*     without a result, or at once when every running alternative has failed.
+*   - The first alternative that returns without throwing wins. The others are cancelled: their
+*     next tce_checkpoint() throws TCE_CANCELLED. tce_hedged() does not wait for them.
+*   - If every alternative throws, a single TCE_AGGREGATE is thrown. Its errors carry the index
+*     of each alternative, its code and its original throw site.
+*   - Losers may still run after tce_hedged() returns, so 'ctx' must outlive them and be safe to
+*     share. A loser that succeeds anyway passes its result to 'discard', if given.
+*   - Alternatives run in the request scope of the caller. Workers are kept for reuse, up to
+*     TCE_HEDGE_IDLE of them.
+*/
+
+#ifndef TCE_HEDGE_MAX
+#define TCE_HEDGE_MAX 8             // Alternatives per call.
+#endif
+
+#ifndef TCE_HEDGE_IDLE
+#define TCE_HEDGE_IDLE 16           // Idle workers kept for later calls.
+#endif
+
+// An alternative. It returns the result, or throws.
+typedef void* (*tce_hedge_fn)(void* ctx);
+
+// The state of one tce_hedged() call, shared with its workers.
+typedef struct __tce_hedge_call_t{
+    mtx_t lock;
+    cnd_t done;
+    atomic_int refs;                // The caller and every started worker.
+    tce_cancel cancel;
+    void* ctx;
+    void (*discard)(void* result);
+    tce_scope scope;
+    int started;
+    int finished;
+    int winner;                     // The index of the winning alternative, or -1.
+    void* result;
+    tce_captured errors[TCE_HEDGE_MAX];
+} __tce_hedge_call;
+
+// A worker thread. It runs one alternative at a time, then parks in the idle list.
+typedef struct __tce_hedge_worker_t{
+    mtx_t lock;
+    cnd_t wake;
+    __tce_hedge_call* call;         // The job, NULL while parked.
+    tce_hedge_fn fn;
+    int index;
+    struct __tce_hedge_worker_t* next;
+} __tce_hedge_worker;
+
+static mtx_t __tce_hedge_idle_lock;
+static once_flag __tce_hedge_once = ONCE_FLAG_INIT;
+static __tce_hedge_worker* __tce_hedge_idle = NULL;
+static int __tce_hedge_nidle = 0;
+
+static inline void __tce_hedge_init(void){
+    mtx_init(&__tce_hedge_idle_lock,mtx_plain);
+}
+
+static inline void __tce_hedge_release(__tce_hedge_call* call){
+    if (atomic_fetch_sub(&call->refs,1) != 1) return;
+    mtx_destroy(&call->lock);
+    cnd_destroy(&call->done);
+    free(call);
+}
+
+// Runs one alternative and reports its outcome to the call.
+static inline void __tce_hedge_run(__tce_hedge_call* call,tce_hedge_fn fn,int index){
+    tce_captured error = {0};
+    void* volatile result = NULL;
+    tce_cancel* prev = tce_cancel_bind(&call->cancel);
+    tce_scope_restore(call->scope);
+    Try {
+        result = fn(call->ctx);
+    } CatchCustom(tce_capture(&error,ErrorCode)) {
+    } End;
+    tce_cancel_bind(prev);
+    tce_scope_set(0,0);
+    mtx_lock(&call->lock);
+    ++call->finished;
+    if (error.code) call->errors[index] = error;
+    else if (call->winner < 0){
+        call->winner = index;
+        call->result = result;
+        tce_cancel_request(&call->cancel);
+    } else if (call->discard) call->discard(result);
+    cnd_signal(&call->done);
+    mtx_unlock(&call->lock);
+    __tce_hedge_release(call);
+}
+
+static inline int __tce_hedge_worker_main(void* arg){
+    __tce_hedge_worker* w = (__tce_hedge_worker*)arg;
+    for (;;){
+        int parked = 0;
+        __tce_hedge_run(w->call,w->fn,w->index);
+        mtx_lock(&w->lock);
+        w->call = NULL;
+        mtx_unlock(&w->lock);
+        mtx_lock(&__tce_hedge_idle_lock);
+        if (__tce_hedge_nidle < TCE_HEDGE_IDLE){
+            w->next = __tce_hedge_idle;
+            __tce_hedge_idle = w;
+            ++__tce_hedge_nidle;
+            parked = 1;
+        }
+        mtx_unlock(&__tce_hedge_idle_lock);
+        if (!parked) break;
+        mtx_lock(&w->lock);
+        while (!w->call) cnd_wait(&w->wake,&w->lock);
+        mtx_unlock(&w->lock);
+    }
+    mtx_destroy(&w->lock);
+    cnd_destroy(&w->wake);
+    free(w);
+    return 0;
+}
+
+// Starts the next alternative of a call on an idle worker, or on a new one.
+static inline void __tce_hedge_start(__tce_hedge_call* call,tce_hedge_fn fn){
+    __tce_hedge_worker* w;
+    int index = call->started++;
+    thrd_t thread;
+    atomic_fetch_add(&call->refs,1);
+    mtx_lock(&__tce_hedge_idle_lock);
+    w = __tce_hedge_idle;
+    if (w){
+        __tce_hedge_idle = w->next;
+        --__tce_hedge_nidle;
+    }
+    mtx_unlock(&__tce_hedge_idle_lock);
+    if (w){
+        mtx_lock(&w->lock);
+        w->fn = fn;
+        w->index = index;
+        w->call = call;
+        cnd_signal(&w->wake);
+        mtx_unlock(&w->lock);
+        return;
+    }
+    w = (__tce_hedge_worker*)malloc(sizeof(__tce_hedge_worker));
+    if (!w) abort();
+    mtx_init(&w->lock,mtx_plain);
+    cnd_init(&w->wake);
+    w->call = call;
+    w->fn = fn;
+    w->index = index;
+    if (thrd_create(&thread,__tce_hedge_worker_main,w) != thrd_success) abort();
+    thrd_detach(thread);
+}
+
+static inline void __tce_hedge_deadline(struct timespec* deadline,unsigned delay_us){
+    timespec_get(deadline,TIME_UTC);
+    deadline->tv_sec += (time_t)(delay_us / 1000000);
+    deadline->tv_nsec += (long)(delay_us % 1000000) * 1000;
+    if (deadline->tv_nsec >= 1000000000L){
+        deadline->tv_nsec -= 1000000000L;
+        ++deadline->tv_sec;
+    }
+}
+
+/**
+* @brief Runs 'alts' as hedged alternatives and returns the result of the first that succeeds.
+* @param delay_us How long to wait for a result before starting the next alternative.
+* @param discard Optional: receives the results of alternatives that succeeded after the winner.
+* @return The result of the winning alternative. Throws TCE_AGGREGATE if every alternative threw.
+*/
+static inline void* tce_hedged(unsigned delay_us,const tce_hedge_fn* alts,int n,void* ctx,void (*discard)(void* result)){
+    __tce_hedge_call* call;
+    tce_captured errors[TCE_HEDGE_MAX];
+    struct timespec deadline;
+    void* result;
+    int winner, hedge = 1;
+    if (n > TCE_HEDGE_MAX) n = TCE_HEDGE_MAX;
+    call_once(&__tce_hedge_once,__tce_hedge_init);
+    call = (__tce_hedge_call*)calloc(1,sizeof(__tce_hedge_call));
+    if (!call) abort();
+    mtx_init(&call->lock,mtx_plain);
+    cnd_init(&call->done);
+    atomic_init(&call->refs,1);
+    call->ctx = ctx;
+    call->discard = discard;
+    call->scope = tce_scope_save();
+    call->winner = -1;
+
+    mtx_lock(&call->lock);
+    while (call->winner < 0 && call->started < n){
+        // Hedge when the delay passed, or at once when nothing is running any more.
+        if (hedge || call->finished == call->started){
+            __tce_hedge_start(call,alts[call->started]);
+            __tce_hedge_deadline(&deadline,delay_us);
+        }
+        hedge = cnd_timedwait(&call->done,&call->lock,&deadline) == thrd_timedout;
+    }
+    while (call->winner < 0 && call->finished < call->started) cnd_wait(&call->done,&call->lock);
+    winner = call->winner;
+    result = call->result;
+    memcpy(errors,call->errors,sizeof(errors));
+    mtx_unlock(&call->lock);
+    __tce_hedge_release(call);
+
+    if (winner < 0){
+        // Every alternative threw: aggregate them with their original sites.
+        TryCollect {
+            for (int i = 0; i < n; ++i) __tce_collect_append(errors[i].code,i,errors[i].file,errors[i].func,errors[i].line);
+        } End;
+    }
+    return result;
+}
+
+#endif // !__TINY_C_EXCEPTION_HEDGE_H
\ No newline at end of file
@@ -0,0 +1,239 @@
+#ifndef __TINY_C_EXCEPTION_IO_H
+#define __TINY_C_EXCEPTION_IO_H
+
+// pread, fsync and friends are POSIX, not C11. Include this header first when compiling with -std=c11.
+#if !defined(_POSIX_C_SOURCE) && !defined(_GNU_SOURCE) && !defined(_DEFAULT_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include "TinyCException.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+/*
+* TinyCException IO - Throwing wrappers of the POSIX I/O calls, and a buffered record reader.
+*
+* SYNTAX:
+*   void read_log(tce_reader* r){            // '*r' is changed in the Try: not a local of this function.
+*       volatile int fd = -1;
+*       *r = (tce_reader){0};                // A zeroed reader can be destroyed.
+*       Try {
+*           tce_slice line;
+*           fd = tce_open("data.log",O_RDONLY,0);
+*           tce_reader_init(r,fd,0);
+*           while (tce_read_line(r,&line)) process(line.ptr,line.len);   // No copy: a view into the buffer.
+*       } Catch(TCE_IO) {
+*           const tce_io_error* e = tce_io_last_error();
+*           fprintf(stderr,"%s %s: %s\n",e->op,e->path,strerror(e->err));
+*       } Finally {
+*           tce_reader_destroy(r);           // Also when tce_read_line threw.
+*           if (fd >= 0) tce_close(fd);
+*       } End;
+*   }
+*
+* NOTES:
+*   - Short reads and writes are completed, and calls interrupted by a signal (EINTR) are retried,
+*     unless the thread was cancelled: tce_checkpoint() runs before each retry.
+*     Only real errors throw TCE_IO; tce_io_last_error() then tells the call, errno and path.
+*     The details are also the payload of the exception (tce_current().payload).
+*   - Calls that take a file descriptor report "fd N" as the path.
+*   - A slice stays valid until the next read from the same reader.
+*/
+
+#ifndef TCE_IO_PATH_MAX
+#define TCE_IO_PATH_MAX 256         // Longer paths are truncated in the error details.
+#endif
+
+#ifndef TCE_READER_BUFFER
+#define TCE_READER_BUFFER 65536     // Default buffer size of a reader. It grows for longer records.
+#endif
+
+// The details of the last TCE_IO thrown on a thread.
+typedef struct tce_io_error_t{
+    int err;                        // The errno of the failed call.
+    const char* op;                 // The name of the call, e.g. "open".
+    char path[TCE_IO_PATH_MAX];
+} tce_io_error;
+
+thread_local static tce_io_error __tce_io_error;
+
+/**
+* @brief Returns the details of the last TCE_IO thrown on this thread.
+*/
+static inline const tce_io_error* tce_io_last_error(void){
+    return &__tce_io_error;
+}
+
+static inline void __tce_io_fail(const char* op,const char* path,int fd){
+    __tce_io_error.err = errno;
+    __tce_io_error.op = op;
+    if (path) snprintf(__tce_io_error.path,sizeof(__tce_io_error.path),"%s",path);
+    else snprintf(__tce_io_error.path,sizeof(__tce_io_error.path),"fd %d",fd);
+    ThrowWith(TCE_IO,&__tce_io_error);
+}
+
+/**
+* @brief Opens a file, retrying on EINTR.
+* @return The file descriptor. Throws TCE_IO on failure.
+*/
+static inline int tce_open(const char* path,int flags,mode_t mode){
+    int fd;
+    while ((fd = open(path,flags,mode)) < 0)
+        if (errno != EINTR) __tce_io_fail("open",path,-1);
+        else tce_checkpoint();
+    return fd;
+}
+
+/**
+* @brief Closes a file descriptor. Throws TCE_IO if close reports an error (e.g. a failed delayed write).
+*        EINTR is not retried: the descriptor is released either way.
+*/
+static inline void tce_close(int fd){
+    if (close(fd) < 0 && errno != EINTR) __tce_io_fail("close",NULL,fd);
+}
+
+/**
+* @brief Reads until 'n' bytes are read or the end of the file is reached.
+* @return The number of bytes read, less than 'n' only at the end of the file.
+*/
+static inline size_t tce_read_full(int fd,void* buf,size_t n){
+    size_t done = 0;
+    while (done < n){
+        ssize_t got = read(fd,(char*)buf + done,n - done);
+        if (got > 0) done += (size_t)got;
+        else if (got == 0) break;
+        else if (errno != EINTR) __tce_io_fail("read",NULL,fd);
+        else tce_checkpoint();
+    }
+    return done;
+}
+
+/**
+* @brief Writes all 'n' bytes.
+*/
+static inline void tce_write_full(int fd,const void* buf,size_t n){
+    size_t done = 0;
+    while (done < n){
+        ssize_t put = write(fd,(const char*)buf + done,n - done);
+        if (put >= 0) done += (size_t)put;
+        else if (errno != EINTR) __tce_io_fail("write",NULL,fd);
+        else tce_checkpoint();
+    }
+}
+
+/**
+* @brief Reads up to 'n' bytes at an offset, without moving the file position.
+* @return The number of bytes read, less than 'n' only at the end of the file.
+*/
+static inline size_t tce_pread(int fd,void* buf,size_t n,off_t offset){
+    size_t done = 0;
+    while (done < n){
+        ssize_t got = pread(fd,(char*)buf + done,n - done,offset + (off_t)done);
+        if (got > 0) done += (size_t)got;
+        else if (got == 0) break;
+        else if (errno != EINTR) __tce_io_fail("pread",NULL,fd);
+        else tce_checkpoint();
+    }
+    return done;
+}
+
+/**
+* @brief Flushes a file to storage.
+*/
+static inline void tce_fsync(int fd){
+    while (fsync(fd) < 0)
+        if (errno != EINTR) __tce_io_fail("fsync",NULL,fd);
+        else tce_checkpoint();
+}
+
+// A view into a reader's buffer.
+typedef struct tce_slice_t{
+    const char* ptr;
+    size_t len;
+} tce_slice;
+
+// A buffered reader returning records as slices into its buffer.
+typedef struct tce_reader_t{
+    int fd;
+    int eof;
+    char* buf;
+    size_t cap;
+    size_t pos;                     // Start of the next record.
+    size_t scan;                    // Bytes from 'pos' already searched for the delimiter.
+    size_t end;                     // End of the buffered data.
+} tce_reader;
+
+/**
+* @brief Initializes a reader over an open file descriptor. The reader does not own it.
+* @param cap The initial buffer size, or 0 for TCE_READER_BUFFER.
+*/
+static inline void tce_reader_init(tce_reader* r,int fd,size_t cap){
+    r->fd = fd;
+    r->eof = 0;
+    r->cap = cap ? cap : TCE_READER_BUFFER;
+    r->buf = (char*)malloc(r->cap);
+    if (!r->buf) abort();
+    r->pos = r->scan = r->end = 0;
+}
+
+// Frees the reader's buffer. A zeroed reader, never initialized, can be destroyed too.
+static inline void tce_reader_destroy(tce_reader* r){
+    free(r->buf);
+    r->buf = NULL;
+}
+
+// Makes room after the buffered data: moves the pending record to the front, or grows the buffer.
+static inline void __tce_reader_fill(tce_reader* r){
+    ssize_t got;
+    if (r->pos){
+        memmove(r->buf,r->buf + r->pos,r->end - r->pos);
+        r->end -= r->pos;
+        r->pos = 0;
+    } else if (r->end == r->cap){
+        char* grown = (char*)realloc(r->buf,r->cap * 2);
+        if (!grown) abort();
+        r->buf = grown;
+        r->cap *= 2;
+    }
+    while ((got = read(r->fd,r->buf + r->end,r->cap - r->end)) < 0)
+        if (errno != EINTR) __tce_io_fail("read",NULL,r->fd);
+        else tce_checkpoint();
+    if (got == 0) r->eof = 1;
+    r->end += (size_t)got;
+}
+
+/**
+* @brief Reads the next record ending with 'delim'. The delimiter is not part of the slice.
+*        The last record of the file may lack the delimiter.
+* @return 1 if a record was read, 0 at the end of the file.
+*/
+static inline int tce_read_record(tce_reader* r,int delim,tce_slice* out){
+    for (;;){
+        const char* start = r->buf + r->pos;
+        const char* hit = (const char*)memchr(start + r->scan,delim,r->end - r->pos - r->scan);
+        if (hit){
+            out->ptr = start;
+            out->len = (size_t)(hit - start);
+            r->pos += out->len + 1;
+            r->scan = 0;
+            return 1;
+        }
+        r->scan = r->end - r->pos;
+        if (r->eof){
+            if (r->pos == r->end) return 0;
+            out->ptr = start;
+            out->len = r->end - r->pos;
+            r->pos = r->end;
+            r->scan = 0;
+            return 1;
+        }
+        __tce_reader_fill(r);
+    }
+}
+
+// Reads the next line, without its '\n'.
+#define tce_read_line(r,out) tce_read_record((r),'\n',(out))
+
+#endif // !__TINY_C_EXCEPTION_IO_H
\ No newline at end of file
@@ -0,0 +1,268 @@
+#ifndef __TINY_C_EXCEPTION_ISOLATE_H
+#define __TINY_C_EXCEPTION_ISOLATE_H
+
+// fork, futex and mmap are not C11. Include this header first when compiling with -std=c11.
+#if !defined(_POSIX_C_SOURCE) && !defined(_GNU_SOURCE) && !defined(_DEFAULT_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+#include "TinyCException.h"
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <linux/futex.h>
+
+/*
+* TinyCException Isolate - Runs untrusted work in a pool of preforked worker processes (Linux).
+*
+* SYNTAX:
+*   size_t parse(const void* in,size_t in_len,void* out,size_t out_cap);   // Runs in a worker.
+*
+*   tce_isolate_pool pool;
+*   tce_isolate_pool_start(&pool,4,1 << 20,250);     // 4 workers, 1 MiB buffers, 250 ms timeout.
+*   Try {
+*       size_t n = tce_isolate(&pool,parse,input,input_len,output,sizeof(output));
+*   } Catch(TCE_ISOLATE_CRASH) {
+*       const tce_isolate_error* e = tce_current().payload;
+*       fprintf(stderr,"the parser died with signal %d\n",e->signal);
+*   } Catch(TCE_ISOLATE_TIMEOUT) {
+*       ...
+*   } End;
+*   tce_isolate_pool_stop(&pool);
+*
+* NOTES:
+*   - The workers are forked by tce_isolate_pool_start, so a call costs a copy of the input and the
+*     output through shared memory and two futex handoffs, not a fork.
+*   - A worker that crashes or runs past the timeout is killed and replaced, and the caller gets
+*     TCE_ISOLATE_CRASH or TCE_ISOLATE_TIMEOUT. An exception escaping the function in the worker is
+*     re-thrown in the caller with its code and throw site.
+*   - 'fn' must be a function of the program, since it's called by address in the worker. Nothing
+*     the function does in the worker, other than its output, is visible to the caller.
+*   - Start the pool before creating threads when possible: a worker is a fork of the process,
+*     and replacing a dead worker forks again.
+*   - Several threads can call tce_isolate on the same pool. Each call takes a free worker.
+*   - An idle worker exits within TCE_ISOLATE_ORPHAN_MS once the process that forked it is gone.
+*     PR_SET_PDEATHSIG would fire when the forking thread exits instead, so a pool started or
+*     refilled from a short-lived thread would lose its workers.
+*/
+
+#ifndef TCE_ISOLATE_MAX_WORKERS
+#define TCE_ISOLATE_MAX_WORKERS 64
+#endif
+
+#ifndef TCE_ISOLATE_POLL_MS
+#define TCE_ISOLATE_POLL_MS 10      // How often a waiting caller checks whether its worker died.
+#endif
+
+#ifndef TCE_ISOLATE_ORPHAN_MS
+#define TCE_ISOLATE_ORPHAN_MS 1000  // How often an idle worker checks whether its parent process died.
+#endif
+
+// The function run in a worker. It returns the number of bytes written to 'out'.
+typedef size_t (*tce_isolate_fn)(const void* in,size_t in_len,void* out,size_t out_cap);
+
+// The details of the last TCE_ISOLATE_CRASH thrown on a thread, also its payload.
+typedef struct tce_isolate_error_t{
+    pid_t pid;                      // The worker that died.
+    int signal;                     // The signal that killed it, or 0 if it exited.
+    int exit_status;                // Its exit status, if it exited.
+} tce_isolate_error;
+
+thread_local static tce_isolate_error __tce_isolate_error;
+
+enum{ __TCE_ISOLATE_IDLE = 0,__TCE_ISOLATE_REQUEST,__TCE_ISOLATE_DONE,__TCE_ISOLATE_STOP };
+
+// The memory a caller and a worker share: a control block, then the input and output buffers.
+typedef struct __tce_isolate_shm_t{
+    atomic_uint state;
+    tce_isolate_fn fn;
+    size_t in_len;
+    size_t out_len;
+    size_t out_cap;
+    tce_captured error;             // An exception that escaped 'fn', error.code == 0 if none.
+    _Alignas(64) char data[];       // Input buffer, then output buffer.
+} __tce_isolate_shm;
+
+typedef struct __tce_isolate_worker_t{
+    pid_t pid;
+    __tce_isolate_shm* shm;
+} __tce_isolate_worker;
+
+// A pool of worker processes.
+typedef struct tce_isolate_pool_t{
+    int nworkers;
+    size_t buffer;                  // Size of the input buffer, and of the output buffer.
+    int timeout_ms;                 // 0 for no timeout.
+    __tce_isolate_worker workers[TCE_ISOLATE_MAX_WORKERS];
+    int free_workers[TCE_ISOLATE_MAX_WORKERS];
+    int nfree;
+    mtx_t lock;
+    cnd_t released;
+} tce_isolate_pool;
+
+static inline long __tce_futex(atomic_uint* addr,int op,unsigned val,const struct timespec* timeout){
+    return syscall(SYS_futex,(uint32_t*)addr,op,val,timeout,NULL,0);
+}
+
+static inline void __tce_isolate_serve(__tce_isolate_shm* shm,size_t buffer,pid_t parent){
+    for (;;){
+        unsigned state;
+        while ((state = atomic_load_explicit(&shm->state,memory_order_acquire)) == __TCE_ISOLATE_IDLE ||
+            state == __TCE_ISOLATE_DONE){
+            struct timespec slice = {TCE_ISOLATE_ORPHAN_MS / 1000,(TCE_ISOLATE_ORPHAN_MS % 1000) * 1000000L};
+            // Reparented: the process that forked this worker is gone.
+            if (getppid() != parent) _exit(0);
+            __tce_futex(&shm->state,FUTEX_WAIT,state,&slice);
+        }
+        if (state == __TCE_ISOLATE_STOP) _exit(0);
+        shm->error.code = 0;
+        Try {
+            shm->out_len = shm->fn(shm->data,shm->in_len,shm->data + buffer,shm->out_cap);
+        } CatchCustom(tce_capture(&shm->error,ErrorCode)) {
+            shm->out_len = 0;
+        } End;
+        atomic_store_explicit(&shm->state,__TCE_ISOLATE_DONE,memory_order_release);
+        __tce_futex(&shm->state,FUTEX_WAKE,1,NULL);
+    }
+}
+
+static inline void __tce_isolate_spawn(tce_isolate_pool* pool,__tce_isolate_worker* w){
+    pid_t parent = getpid();
+    atomic_store(&w->shm->state,__TCE_ISOLATE_IDLE);
+    fflush(NULL);   // Buffered output would otherwise be written twice.
+    w->pid = fork();
+    if (w->pid < 0) abort();
+    if (w->pid == 0){
+        __exp_stack_top = NULL;     // The frames of the forking thread are not the worker's.
+        __tce_handling = NULL;
+        __tce_isolate_serve(w->shm,pool->buffer,parent);
+    }
+}
+
+/**
+* @brief Forks the workers of a pool.
+* @param workers Number of worker processes (at most TCE_ISOLATE_MAX_WORKERS).
+* @param buffer Size of the input buffer and of the output buffer of each worker.
+* @param timeout_ms Time a call may take before its worker is killed, or 0 for no limit.
+*/
+static inline void tce_isolate_pool_start(tce_isolate_pool* pool,int workers,size_t buffer,int timeout_ms){
+    if (workers < 1) workers = 1;
+    if (workers > TCE_ISOLATE_MAX_WORKERS) workers = TCE_ISOLATE_MAX_WORKERS;
+    pool->nworkers = workers;
+    pool->buffer = buffer;
+    pool->timeout_ms = timeout_ms;
+    pool->nfree = workers;
+    mtx_init(&pool->lock,mtx_plain);
+    cnd_init(&pool->released);
+    for (int i = 0; i < workers; ++i){
+        __tce_isolate_worker* w = &pool->workers[i];
+        w->shm = (__tce_isolate_shm*)mmap(NULL,sizeof(__tce_isolate_shm) + 2 * buffer,
+            PROT_READ | PROT_WRITE,MAP_SHARED | MAP_ANONYMOUS,-1,0);
+        if (w->shm == MAP_FAILED) abort();
+        __tce_isolate_spawn(pool,w);
+        pool->free_workers[i] = i;
+    }
+}
+
+/**
+* @brief Stops the workers and releases the pool. No call may be running.
+*/
+static inline void tce_isolate_pool_stop(tce_isolate_pool* pool){
+    for (int i = 0; i < pool->nworkers; ++i){
+        __tce_isolate_worker* w = &pool->workers[i];
+        atomic_store_explicit(&w->shm->state,__TCE_ISOLATE_STOP,memory_order_release);
+        __tce_futex(&w->shm->state,FUTEX_WAKE,1,NULL);
+        while (waitpid(w->pid,NULL,0) < 0 && errno == EINTR);
+        munmap(w->shm,sizeof(__tce_isolate_shm) + 2 * pool->buffer);
+    }
+    mtx_destroy(&pool->lock);
+    cnd_destroy(&pool->released);
+}
+
+static inline long long __tce_isolate_now_ms(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Waits for the worker to answer. Returns 0 when it did, or the reserved code of its failure.
+static inline int __tce_isolate_wait(tce_isolate_pool* pool,__tce_isolate_worker* w){
+    long long deadline = pool->timeout_ms ? __tce_isolate_now_ms() + pool->timeout_ms : 0;
+    for (;;){
+        int status;
+        struct timespec slice = {0,TCE_ISOLATE_POLL_MS * 1000000L};
+        if (atomic_load_explicit(&w->shm->state,memory_order_acquire) == __TCE_ISOLATE_DONE) return 0;
+        __tce_futex(&w->shm->state,FUTEX_WAIT,__TCE_ISOLATE_REQUEST,&slice);
+        if (atomic_load_explicit(&w->shm->state,memory_order_acquire) == __TCE_ISOLATE_DONE) return 0;
+        if (waitpid(w->pid,&status,WNOHANG) == w->pid){
+            __tce_isolate_error.pid = w->pid;
+            __tce_isolate_error.signal = WIFSIGNALED(status) ? WTERMSIG(status) : 0;
+            __tce_isolate_error.exit_status = WIFEXITED(status) ? WEXITSTATUS(status) : 0;
+            return TCE_ISOLATE_CRASH;
+        }
+        if (deadline && __tce_isolate_now_ms() >= deadline){
+            kill(w->pid,SIGKILL);
+            while (waitpid(w->pid,NULL,0) < 0 && errno == EINTR);
+            return TCE_ISOLATE_TIMEOUT;
+        }
+    }
+}
+
+/**
+* @brief Runs fn(in,in_len,out,out_cap) in a worker process of the pool.
+* @return The number of bytes the function wrote to 'out'.
+*         Throws TCE_ISOLATE_CRASH, TCE_ISOLATE_TIMEOUT, TCE_ISOLATE_LIMIT if the input does not fit
+*         the pool's buffers, or the exception that escaped the function in the worker.
+*/
+static inline size_t tce_isolate(tce_isolate_pool* pool,tce_isolate_fn fn,const void* in,size_t in_len,void* out,size_t out_cap){
+    __tce_isolate_worker* w;
+    size_t out_len = 0;
+    tce_captured error;
+    int failure;
+    if (in_len > pool->buffer) Throw(TCE_ISOLATE_LIMIT);
+    if (out_cap > pool->buffer) out_cap = pool->buffer;
+    mtx_lock(&pool->lock);
+    while (!pool->nfree) cnd_wait(&pool->released,&pool->lock);
+    w = &pool->workers[pool->free_workers[--pool->nfree]];
+    mtx_unlock(&pool->lock);
+
+    w->shm->fn = fn;
+    w->shm->in_len = in_len;
+    w->shm->out_cap = out_cap;
+    memcpy(w->shm->data,in,in_len);
+    atomic_store_explicit(&w->shm->state,__TCE_ISOLATE_REQUEST,memory_order_release);
+    __tce_futex(&w->shm->state,FUTEX_WAKE,1,NULL);
+    failure = __tce_isolate_wait(pool,w);
+    if (failure){
+        __tce_isolate_spawn(pool,w);
+    } else{
+        error = w->shm->error;
+        if (!error.code){
+            out_len = w->shm->out_len < out_cap ? w->shm->out_len : out_cap;
+            memcpy(out,w->shm->data + pool->buffer,out_len);
+        }
+        atomic_store_explicit(&w->shm->state,__TCE_ISOLATE_IDLE,memory_order_relaxed);
+    }
+
+    mtx_lock(&pool->lock);
+    pool->free_workers[pool->nfree++] = (int)(w - pool->workers);
+    cnd_signal(&pool->released);
+    mtx_unlock(&pool->lock);
+    if (failure == TCE_ISOLATE_CRASH) ThrowWith(TCE_ISOLATE_CRASH,&__tce_isolate_error);
+    if (failure) Throw(failure);
+    if (error.code){
+        error.payload = NULL;       // It pointed into the worker's memory.
+        tce_rethrow(&error);
+    }
+    return out_len;
+}
+
+#endif // !__TINY_C_EXCEPTION_ISOLATE_H
\ No newline at end of file
@@ -0,0 +1,244 @@
+#ifndef __TINY_C_EXCEPTION_JOB_H
+#define __TINY_C_EXCEPTION_JOB_H
+
+// mmap and msync are POSIX, not C11. Include this header first when compiling with -std=c11.
+#if !defined(_POSIX_C_SOURCE) && !defined(_GNU_SOURCE) && !defined(_DEFAULT_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include "TinyCException_IO.h"
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+* TinyCException Job - Resumable batch jobs, with their progress in an mmap'ed checkpoint file.
+*
+* SYNTAX:
+*   static void convert(unsigned long long i,void* ctx){ ... Throw(BadRecord); ... }
+*
+*   tce_job job;
+*   tce_job_open(&job,"nightly.ckpt",nrecords,100);      // Resumes where the last run stopped.
+*   tce_job_run(&job,convert,records);
+*   for (size_t i = 0; i < tce_job_nfailures(&job); ++i){
+*       const tce_job_failure* f = tce_job_failure_at(&job,i);
+*       printf("record %llu failed: %s\n",(unsigned long long)f->index,tce_strerror(f->code));
+*   }
+*   tce_job_close(&job);
+*
+* NOTES:
+*   - Items run in order under one Try per batch of TCE_JOB_BATCH items, so the happy path costs
+*     one setjmp per batch. An item that throws is recorded as a failure (its index, code and
+*     throw line) and the batch goes on with the next item.
+*   - The checkpoint holds the committed index: every item before it is done or failed. It's
+*     updated in the mapping after every item, so a process that dies loses nothing that the
+*     kernel has not written out yet. msync makes it durable every TCE_JOB_SYNC batches.
+*   - A restart with the same file and item count skips the committed items. A file left by a
+*     different job throws TCE_IO with EINVAL.
+*   - An exception that cannot be recorded stops the job: TCE_CANCELLED, or any exception once
+*     'max_failures' are recorded. The checkpoint is synced, the item stays uncommitted, and the
+*     exception is re-thrown from tce_job_run.
+*   - While a job is open, the terminate handler of the thread that opened it syncs the
+*     checkpoints of every open job before the program aborts on an uncaught exception. It then
+*     calls the handler that was set before the thread's first open job, which is restored when
+*     the thread's last open job is closed, in whatever order they are closed.
+*/
+
+#ifndef TCE_JOB_BATCH
+#define TCE_JOB_BATCH 256           // Items per Try frame.
+#endif
+
+#ifndef TCE_JOB_SYNC
+#define TCE_JOB_SYNC 64             // Batches per msync.
+#endif
+
+#define __TCE_JOB_MAGIC "TCEJOB1"
+
+// A failed item, as recorded in the checkpoint.
+typedef struct tce_job_failure_t{
+    uint64_t index;
+    int32_t code;
+    int32_t line;                   // The line of the throw.
+} tce_job_failure;
+
+// The layout of a checkpoint file.
+typedef struct __tce_job_file_t{
+    char magic[8];
+    uint64_t total;                 // Items in the job.
+    uint64_t committed;             // Items before this index are done or failed.
+    uint64_t capacity;              // Failures the file can hold.
+    uint64_t nfailures;
+    tce_job_failure failures[];
+} __tce_job_file;
+
+typedef struct tce_job_t{
+    int fd;
+    __tce_job_file* file;
+    size_t size;
+    unsigned batches;               // Batches since the last msync.
+    void (*fn)(unsigned long long index,void* ctx);
+    void* ctx;
+    struct tce_job_t* next;         // The next open job.
+} tce_job;
+
+static mtx_t __tce_jobs_lock;
+static once_flag __tce_jobs_once = ONCE_FLAG_INIT;
+static tce_job* __tce_jobs = NULL;
+thread_local static int __tce_jobs_open = 0;                    // Jobs opened by this thread and not closed.
+thread_local static void (*__tce_jobs_prev_handle)(int) = NULL; // The terminate handler before the first of them.
+
+static inline void __tce_jobs_init(void){
+    mtx_init(&__tce_jobs_lock,mtx_plain);
+}
+
+/**
+* @brief Makes the checkpoint durable.
+*/
+static inline void tce_job_sync(tce_job* job){
+    if (msync(job->file,job->size,MS_SYNC) < 0) __tce_io_fail("msync",NULL,job->fd);
+    job->batches = 0;
+}
+
+// Terminate handler while jobs are open: flush them, then chain to the previous handler.
+static inline void __tce_job_terminate(int code){
+    mtx_lock(&__tce_jobs_lock);
+    for (tce_job* job = __tce_jobs; job; job = job->next) msync(job->file,job->size,MS_SYNC);
+    mtx_unlock(&__tce_jobs_lock);
+    if (__tce_jobs_prev_handle) __tce_jobs_prev_handle(code);
+}
+
+/**
+* @brief Opens a job's checkpoint, creating it if needed.
+* @param total The number of items. An existing checkpoint must be for the same number.
+* @param max_failures How many failed items are recorded before a failure stops the job.
+*        Throws TCE_IO if the file cannot be opened or mapped, or belongs to another job.
+*/
+static inline void tce_job_open(tce_job* job,const char* path,unsigned long long total,unsigned long long max_failures){
+    struct stat st;
+    int fd = tce_open(path,O_RDWR | O_CREAT,0644);
+    size_t size = sizeof(__tce_job_file) + (size_t)max_failures * sizeof(tce_job_failure);
+    __tce_job_file* file;
+    if (fstat(fd,&st) < 0){
+        close(fd);
+        __tce_io_fail("fstat",path,-1);
+    }
+    if (st.st_size == 0){
+        if (ftruncate(fd,(off_t)size) < 0){
+            close(fd);
+            __tce_io_fail("ftruncate",path,-1);
+        }
+    } else size = (size_t)st.st_size;
+    file = (__tce_job_file*)mmap(NULL,size,PROT_READ | PROT_WRITE,MAP_SHARED,fd,0);
+    if (file == MAP_FAILED){
+        close(fd);
+        __tce_io_fail("mmap",path,-1);
+    }
+    if (st.st_size == 0){
+        file->total = total;
+        file->committed = 0;
+        file->capacity = max_failures;
+        file->nfailures = 0;
+        memcpy(file->magic,__TCE_JOB_MAGIC,sizeof(file->magic));
+    } else if (size < sizeof(__tce_job_file) || memcmp(file->magic,__TCE_JOB_MAGIC,sizeof(file->magic)) ||
+        file->total != total || size < sizeof(__tce_job_file) + file->capacity * sizeof(tce_job_failure)){
+        munmap(file,size);
+        close(fd);
+        errno = EINVAL;
+        __tce_io_fail("tce_job_open",path,-1);
+    }
+    job->fd = fd;
+    job->file = file;
+    job->size = size;
+    job->batches = 0;
+    call_once(&__tce_jobs_once,__tce_jobs_init);
+    mtx_lock(&__tce_jobs_lock);
+    job->next = __tce_jobs;
+    __tce_jobs = job;
+    mtx_unlock(&__tce_jobs_lock);
+    // Installed once per thread: the handler it replaces is never the job handler itself.
+    if (!__tce_jobs_open++){
+        __tce_jobs_prev_handle = (void (*)(int))__terminate_handle;
+        set_exception_terminate_handle(__tce_job_terminate);
+    }
+}
+
+/**
+* @brief Syncs and closes a job's checkpoint. Call it on the thread that opened the job.
+*/
+static inline void tce_job_close(tce_job* job){
+    mtx_lock(&__tce_jobs_lock);
+    for (tce_job** p = &__tce_jobs; *p; p = &(*p)->next)
+        if (*p == job){
+            *p = job->next;
+            break;
+        }
+    mtx_unlock(&__tce_jobs_lock);
+    if (__tce_jobs_open > 0 && !--__tce_jobs_open){
+        set_exception_terminate_handle(__tce_jobs_prev_handle);
+        __tce_jobs_prev_handle = NULL;
+    }
+    msync(job->file,job->size,MS_SYNC);
+    munmap(job->file,job->size);
+    tce_close(job->fd);
+}
+
+// Returns the number of items done or failed, in this run and the previous ones.
+static inline unsigned long long tce_job_committed(const tce_job* job){
+    return job->file->committed;
+}
+
+// Returns the number of failed items recorded.
+static inline size_t tce_job_nfailures(const tce_job* job){
+    return (size_t)job->file->nfailures;
+}
+
+// Returns a recorded failure, oldest first.
+static inline const tce_job_failure* tce_job_failure_at(const tce_job* job,size_t i){
+    return &job->file->failures[i];
+}
+
+// Runs items until the end of the batch. The committed index is the item running.
+static inline void __tce_job_batch(tce_job* job){
+    __tce_job_file* file = job->file;
+    uint64_t end = file->committed + TCE_JOB_BATCH;
+    if (end > file->total) end = file->total;
+    while (file->committed < end){
+        job->fn(file->committed,job->ctx);
+        ++file->committed;
+    }
+}
+
+// Records the failure of the running item and commits it. Returns 0 if the job must stop instead.
+static inline int __tce_job_fail(tce_job* job,int code){
+    __tce_job_file* file = job->file;
+    tce_job_failure* f;
+    if (code == TCE_CANCELLED || file->nfailures >= file->capacity) return 0;
+    f = &file->failures[file->nfailures];
+    f->index = file->committed;
+    f->code = code;
+    f->line = __exception_detail_s.line;     // The arm has not started yet: read the throw being dispatched.
+    ++file->nfailures;
+    ++file->committed;
+    return 1;
+}
+
+/**
+* @brief Runs the job's items from its committed index to its end, calling 'fn' for each.
+*        Failed items are recorded. Re-throws an exception that stops the job, after syncing.
+*/
+static inline void tce_job_run(tce_job* job,void (*fn)(unsigned long long index,void* ctx),void* ctx){
+    job->fn = fn;
+    job->ctx = ctx;
+    while (job->file->committed < job->file->total){
+        TryFn(job,__tce_job_batch)
+        CatchCustom(__tce_job_fail(job,ErrorCode)) {
+        } Finally {
+            // An exception still set here stops the job: save the progress before it leaves.
+            if (ErrorCode) tce_job_sync(job);
+        } End;
+        if (++job->batches >= TCE_JOB_SYNC) tce_job_sync(job);
+    }
+    tce_job_sync(job);
+}
+
+#endif // !__TINY_C_EXCEPTION_JOB_H
\ No newline at end of file
@@ -0,0 +1,266 @@
+#ifndef __TINY_C_EXCEPTION_METRICS_H
+#define __TINY_C_EXCEPTION_METRICS_H
+
+// Sockets and poll are POSIX, not C11. Include this header first when compiling with -std=c11.
+#if !defined(_POSIX_C_SOURCE) && !defined(_GNU_SOURCE) && !defined(_DEFAULT_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#ifndef TCE_ENABLE_STATS
+#define TCE_ENABLE_STATS
+#endif
+
+#include "TinyCException.h"
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/*
+* TinyCException Metrics - Serves the exception statistics in OpenMetrics text format
+* over a Unix domain socket.
+*
+* SYNTAX:
+*   tce_metrics_start("/run/app/tce.sock");    // Starts the exporter thread.
+*   ...
+*   tce_metrics_stop();
+*
+*   curl --unix-socket /run/app/tce.sock http://localhost/metrics
+*
+* NOTES:
+*   - This header enables TCE_ENABLE_STATS. Include it before any other include of TinyCException.h.
+*   - Exported: throws, catches and uncaught exceptions, the catch ratio, throws by code, by site
+*     and by tenant, and histograms of the unwind depth and of the throw-to-catch latency.
+*     With TCE_STACK_STATS, also the peak Try depth and stack offset, by Try site.
+*   - A scrape reads each thread's counters under its seqlock: workers never wait for it.
+*   - A request starting with "GET" gets an HTTP response. Any other client gets the text alone.
+*/
+
+// A growing text buffer.
+typedef struct __tce_text_t{
+    char* data;
+    size_t len;
+    size_t cap;
+} __tce_text;
+
+static inline void __tce_text_printf(__tce_text* t,const char* format,...){
+    for (;;){
+        va_list args;
+        int n;
+        va_start(args,format);
+        n = vsnprintf(t->data + t->len,t->cap - t->len,format,args);
+        va_end(args);
+        if (n < 0) return;
+        if ((size_t)n < t->cap - t->len){
+            t->len += (size_t)n;
+            return;
+        }
+        t->cap = (t->cap + (size_t)n) * 2;
+        t->data = (char*)realloc(t->data,t->cap);
+        if (!t->data) abort();
+    }
+}
+
+// Appends a label value, escaped as OpenMetrics requires.
+static inline void __tce_text_label(__tce_text* t,const char* value){
+    for (; value && *value; ++value){
+        if (*value == '\\') __tce_text_printf(t,"\\\\");
+        else if (*value == '"') __tce_text_printf(t,"\\\"");
+        else if (*value == '\n') __tce_text_printf(t,"\\n");
+        else __tce_text_printf(t,"%c",*value);
+    }
+}
+
+static inline void __tce_metrics_family(__tce_text* t,const char* name,const char* type,const char* help){
+    __tce_text_printf(t,"# TYPE %s %s\n# HELP %s %s\n",name,type,name,help);
+}
+
+/**
+* @brief Renders the current statistics in OpenMetrics text format.
+* @return A malloc'ed, NUL-terminated string. The caller frees it.
+*/
+static inline char* tce_metrics_render(size_t* length){
+    tce_stats st;
+    tce_stats_detail* d = (tce_stats_detail*)malloc(sizeof(tce_stats_detail));
+    __tce_text t = {NULL,0,0};
+    unsigned long long cumulative = 0;
+    if (!d) abort();
+    t.cap = 16384;
+    if (!(t.data = (char*)malloc(t.cap))) abort();
+    t.data[0] = '\0';
+    tce_stats_snapshot(&st);
+    tce_stats_detail_snapshot(d);
+
+    __tce_metrics_family(&t,"tce_throws","counter","Exceptions thrown.");
+    __tce_text_printf(&t,"tce_throws_total %llu\n",st.throws);
+    __tce_metrics_family(&t,"tce_catches","counter","Exceptions handled by a Catch arm.");
+    __tce_text_printf(&t,"tce_catches_total %llu\n",st.catches);
+    __tce_metrics_family(&t,"tce_uncaught","counter","Exceptions that reached the terminate path.");
+    __tce_text_printf(&t,"tce_uncaught_total %llu\n",st.uncaught);
+    __tce_metrics_family(&t,"tce_catch_ratio","gauge","Catches per throw.");
+    __tce_text_printf(&t,"tce_catch_ratio %g\n",st.throws ? (double)st.catches / (double)st.throws : 1.0);
+
+    __tce_metrics_family(&t,"tce_throws_by_code","counter","Exceptions thrown, by code.");
+    for (int i = 0; i < d->ncodes; ++i){
+        const char* name = tce_errname(d->codes[i].code);
+        __tce_text_printf(&t,"tce_throws_by_code_total{code=\"%d\"",d->codes[i].code);
+        if (name) __tce_text_printf(&t,",name=\"%s\"",name);
+        __tce_text_printf(&t,"} %llu\n",d->codes[i].throws);
+    }
+    if (d->other_codes) __tce_text_printf(&t,"tce_throws_by_code_total{code=\"other\"} %llu\n",d->other_codes);
+
+    __tce_metrics_family(&t,"tce_throws_by_site","counter","Exceptions thrown, by throw site.");
+    for (int i = 0; i < d->nsites; ++i){
+        __tce_text_printf(&t,"tce_throws_by_site_total{file=\"");
+        __tce_text_label(&t,d->sites[i].file);
+        __tce_text_printf(&t,"\",line=\"%d\"} %llu\n",d->sites[i].line,d->sites[i].throws);
+    }
+    if (d->other_sites) __tce_text_printf(&t,"tce_throws_by_site_total{file=\"other\",line=\"0\"} %llu\n",d->other_sites);
+
+    __tce_metrics_family(&t,"tce_throws_by_tenant","counter","Exceptions thrown, by tenant (heaviest tenants, may overestimate).");
+    for (int i = 0; i < st.ntenants; ++i)
+        __tce_text_printf(&t,"tce_throws_by_tenant_total{tenant=\"%llu\"} %llu\n",st.tenants[i].tenant_id,st.tenants[i].throws);
+
+    __tce_metrics_family(&t,"tce_unwind_depth","histogram","Frames an exception crossed before it was caught.");
+    for (int i = 0; i < TCE_STATS_DEPTHS - 1; ++i){
+        cumulative += d->unwind[i];
+        __tce_text_printf(&t,"tce_unwind_depth_bucket{le=\"%d\"} %llu\n",i,cumulative);
+    }
+    cumulative += d->unwind[TCE_STATS_DEPTHS - 1];
+    __tce_text_printf(&t,"tce_unwind_depth_bucket{le=\"+Inf\"} %llu\ntce_unwind_depth_count %llu\ntce_unwind_depth_sum %llu\n",
+        cumulative,cumulative,d->unwind_sum);
+
+#ifdef TCE_STACK_STATS
+    {
+        tce_stack_site sites[TCE_STATS_SITES];
+        int n = tce_stack_sites(sites,TCE_STATS_SITES);
+        if (n > TCE_STATS_SITES) n = TCE_STATS_SITES;
+        __tce_metrics_family(&t,"tce_try_depth_max","gauge","Deepest nesting of Try blocks, by Try site.");
+        __tce_text_printf(&t,"tce_try_depth_max %d\n",st.max_depth);
+        for (int i = 0; i < n; ++i){
+            __tce_text_printf(&t,"tce_try_depth_max{file=\"");
+            __tce_text_label(&t,sites[i].file);
+            __tce_text_printf(&t,"\",line=\"%d\"} %d\n",sites[i].line,sites[i].max_depth);
+        }
+        __tce_metrics_family(&t,"tce_stack_peak_bytes","gauge","Deepest Try frame, in bytes from the thread's stack base, by Try site.");
+        __tce_text_printf(&t,"tce_stack_peak_bytes %zu\n",st.max_stack);
+        for (int i = 0; i < n; ++i){
+            __tce_text_printf(&t,"tce_stack_peak_bytes{file=\"");
+            __tce_text_label(&t,sites[i].file);
+            __tce_text_printf(&t,"\",line=\"%d\"} %zu\n",sites[i].line,sites[i].max_stack);
+        }
+    }
+#endif
+
+    cumulative = 0;
+    __tce_metrics_family(&t,"tce_catch_latency_seconds","histogram","Time from throw to catch.");
+    for (int i = 0; i < TCE_STATS_LATENCIES - 1; ++i){
+        cumulative += d->latency[i];
+        __tce_text_printf(&t,"tce_catch_latency_seconds_bucket{le=\"%.9g\"} %llu\n",(double)(1ULL << i) * 1e-9,cumulative);
+    }
+    cumulative += d->latency[TCE_STATS_LATENCIES - 1];
+    __tce_text_printf(&t,"tce_catch_latency_seconds_bucket{le=\"+Inf\"} %llu\ntce_catch_latency_seconds_count %llu\n"
+        "tce_catch_latency_seconds_sum %.9f\n# EOF\n",cumulative,cumulative,(double)d->latency_sum_ns * 1e-9);
+    free(d);
+    if (length) *length = t.len;
+    return t.data;
+}
+
+static struct{
+    int fd;
+    thrd_t thread;
+    atomic_int stopping;
+    char path[sizeof(((struct sockaddr_un*)0)->sun_path)];
+} __tce_metrics = {.fd = -1};
+
+static inline void __tce_metrics_write(int fd,const char* data,size_t len){
+    while (len){
+        ssize_t n = send(fd,data,len,MSG_NOSIGNAL);   // A scraper that hung up must not raise SIGPIPE.
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return;
+        data += n;
+        len -= (size_t)n;
+    }
+}
+
+static inline void __tce_metrics_serve(int client){
+    char request[1024];
+    ssize_t got = 0;
+    size_t len;
+    char* body;
+    struct pollfd pfd = {client,POLLIN,0};
+    // Scrapers send a request first. Wait briefly for it, without waiting on silent clients.
+    if (poll(&pfd,1,100) > 0) got = read(client,request,sizeof(request));
+    body = tce_metrics_render(&len);
+    if (got >= 3 && !strncmp(request,"GET",3)){
+        char header[160];
+        int n = snprintf(header,sizeof(header),"HTTP/1.0 200 OK\r\nContent-Type: application/openmetrics-text; "
+            "version=1.0.0; charset=utf-8\r\nContent-Length: %zu\r\n\r\n",len);
+        __tce_metrics_write(client,header,(size_t)n);
+    }
+    __tce_metrics_write(client,body,len);
+    free(body);
+}
+
+static inline int __tce_metrics_loop(void* arg){
+    (void)arg;
+    while (!atomic_load(&__tce_metrics.stopping)){
+        struct pollfd pfd = {__tce_metrics.fd,POLLIN,0};
+        int client;
+        if (poll(&pfd,1,200) <= 0) continue;
+        if ((client = accept(__tce_metrics.fd,NULL,NULL)) < 0) continue;
+        __tce_metrics_serve(client);
+        close(client);
+    }
+    return 0;
+}
+
+/**
+* @brief Starts the exporter thread, listening on a Unix domain socket.
+*        An existing socket file at 'path' is replaced.
+* @return 0 on success, -1 if the socket cannot be created (errno tells why).
+*/
+static inline int tce_metrics_start(const char* path){
+    struct sockaddr_un addr;
+    int fd;
+    if (strlen(path) >= sizeof(addr.sun_path)){
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memset(&addr,0,sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path,path);
+    if ((fd = socket(AF_UNIX,SOCK_STREAM,0)) < 0) return -1;
+    unlink(path);
+    if (bind(fd,(struct sockaddr*)&addr,sizeof(addr)) < 0 || listen(fd,16) < 0){
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    strcpy(__tce_metrics.path,path);
+    __tce_metrics.fd = fd;
+    atomic_store(&__tce_metrics.stopping,0);
+    if (thrd_create(&__tce_metrics.thread,__tce_metrics_loop,NULL) != thrd_success){
+        close(fd);
+        unlink(path);
+        __tce_metrics.fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+// Stops the exporter thread and removes its socket.
+static inline void tce_metrics_stop(void){
+    if (__tce_metrics.fd < 0) return;
+    atomic_store(&__tce_metrics.stopping,1);
+    thrd_join(__tce_metrics.thread,NULL);
+    close(__tce_metrics.fd);
+    unlink(__tce_metrics.path);
+    __tce_metrics.fd = -1;
+}
+
+#endif // !__TINY_C_EXCEPTION_METRICS_H
\ No newline at end of file
@@ -0,0 +1,315 @@
+#ifndef __TINY_C_EXCEPTION_PIPELINE_H
+#define __TINY_C_EXCEPTION_PIPELINE_H
+
+#include "TinyCException.h"
+#include <stdatomic.h>
+#include <stddef.h>
+
+/*
+* TinyCException Pipeline - A multi-stage pipeline with per-stage error sinks and backpressure.
+*
+* SYNTAX:
+*   tce_pipeline p;
+*   tce_pipeline_init(&p,1024);                              // Ring capacity between stages.
+*   tce_pipeline_add_stage(&p,parse,NULL,4,parse_errors);    // 4 workers.
+*   tce_pipeline_add_stage(&p,store,db,1,NULL);
+*   tce_pipeline_set_fatal(&p,is_fatal);
+*   tce_pipeline_start(&p);
+*   while ((item = next_input())) if (!tce_pipeline_push(&p,item)) break;
+*   tce_pipeline_close(&p);
+*   tce_pipeline_join(&p);      // Re-throws the fatal exception, if one cancelled the pipeline.
+*
+* NOTES:
+*   - A stage function 'void* fn(void* item,void* ctx)' returns the item for the next stage,
+*     or NULL to drop it. The value returned by the last stage is ignored.
+*   - Workers take items in batches and arm one 'Try' per batch. A throwing item is sent to
+*     the stage's error sink with its code and site, and the rest of the batch keeps going.
+*   - If the fatal predicate accepts a code, the pipeline is cancelled. Every stage stops, the
+*     stages are joined in order, and items still queued are passed to the drop handler.
+*   - A full ring blocks the stage feeding it, so a slow stage slows down its producers
+*     instead of growing memory.
+*/
+
+#ifndef TCE_PIPELINE_MAX_STAGES
+#define TCE_PIPELINE_MAX_STAGES 16
+#endif
+
+#ifndef TCE_STAGE_MAX_WORKERS
+#define TCE_STAGE_MAX_WORKERS 32
+#endif
+
+#ifndef TCE_PIPELINE_BATCH
+#define TCE_PIPELINE_BATCH 32       // Items processed under one armed Try.
+#endif
+
+// A cell of a bounded ring. 'seq' tells producers and consumers whose turn it is.
+typedef struct __tce_ring_cell_t{
+    atomic_size_t seq;
+    void* item;
+} __tce_ring_cell;
+
+// A bounded lock-free MPMC ring (Vyukov). Works as well with a single producer and consumer.
+typedef struct tce_ring_t{
+    __tce_ring_cell* cells;
+    size_t mask;
+    _Alignas(64) atomic_size_t head;   // Next position to pop.
+    _Alignas(64) atomic_size_t tail;   // Next position to push.
+} tce_ring;
+
+static inline void tce_ring_init(tce_ring* r,size_t capacity){
+    size_t size = 2;
+    while (size < capacity) size <<= 1;
+    r->cells = (__tce_ring_cell*)malloc(sizeof(__tce_ring_cell) * size);
+    if (!r->cells) abort();
+    for (size_t i = 0; i < size; ++i) atomic_init(&r->cells[i].seq,i);
+    r->mask = size - 1;
+    atomic_init(&r->head,0);
+    atomic_init(&r->tail,0);
+}
+
+static inline void tce_ring_destroy(tce_ring* r){
+    free(r->cells);
+    r->cells = NULL;
+}
+
+/**
+* @brief Pushes an item without blocking.
+* @return 1 on success, 0 if the ring is full.
+*/
+static inline int tce_ring_push(tce_ring* r,void* item){
+    size_t pos = atomic_load_explicit(&r->tail,memory_order_relaxed);
+    for (;;){
+        __tce_ring_cell* cell = &r->cells[pos & r->mask];
+        size_t seq = atomic_load_explicit(&cell->seq,memory_order_acquire);
+        ptrdiff_t diff = (ptrdiff_t)seq - (ptrdiff_t)pos;
+        if (diff == 0){
+            if (atomic_compare_exchange_weak_explicit(&r->tail,&pos,pos + 1,memory_order_relaxed,memory_order_relaxed)){
+                cell->item = item;
+                atomic_store_explicit(&cell->seq,pos + 1,memory_order_release);
+                return 1;
+            }
+        } else if (diff < 0){
+            return 0;
+        } else{
+            pos = atomic_load_explicit(&r->tail,memory_order_relaxed);
+        }
+    }
+}
+
+/**
+* @brief Pops an item without blocking.
+* @return 1 on success, 0 if the ring is empty.
+*/
+static inline int tce_ring_pop(tce_ring* r,void** item){
+    size_t pos = atomic_load_explicit(&r->head,memory_order_relaxed);
+    for (;;){
+        __tce_ring_cell* cell = &r->cells[pos & r->mask];
+        size_t seq = atomic_load_explicit(&cell->seq,memory_order_acquire);
+        ptrdiff_t diff = (ptrdiff_t)seq - (ptrdiff_t)(pos + 1);
+        if (diff == 0){
+            if (atomic_compare_exchange_weak_explicit(&r->head,&pos,pos + 1,memory_order_relaxed,memory_order_relaxed)){
+                *item = cell->item;
+                atomic_store_explicit(&cell->seq,pos + r->mask + 1,memory_order_release);
+                return 1;
+            }
+        } else if (diff < 0){
+            return 0;
+        } else{
+            pos = atomic_load_explicit(&r->head,memory_order_relaxed);
+        }
+    }
+}
+
+struct tce_pipeline_t;
+
+// A pipeline stage: its function, its workers and the ring feeding it.
+typedef struct tce_stage_t{
+    void* (*fn)(void* item,void* ctx);
+    void* ctx;
+    void (*on_error)(void* item,const tce_captured* error,void* ctx);  // The stage's error sink.
+    int workers;
+    int index;
+    atomic_int live;                 // Workers still running.
+    tce_ring in;
+    struct tce_pipeline_t* pipeline;
+    thrd_t threads[TCE_STAGE_MAX_WORKERS];
+} tce_stage;
+
+typedef struct tce_pipeline_t{
+    int nstages;
+    size_t capacity;
+    atomic_int closed;               // No more input will be pushed.
+    atomic_int cancelled;            // A fatal exception stopped the pipeline.
+    int (*is_fatal)(int code);
+    void (*on_drop)(void* item);     // Receives items abandoned on cancellation.
+    tce_captured fatal;              // The exception that cancelled the pipeline.
+    tce_stage stages[TCE_PIPELINE_MAX_STAGES];
+} tce_pipeline;
+
+/**
+* @brief Initializes an empty pipeline.
+* @param capacity The capacity of the ring in front of each stage (rounded up to a power of two).
+*/
+static inline void tce_pipeline_init(tce_pipeline* p,size_t capacity){
+    p->nstages = 0;
+    p->capacity = capacity;
+    atomic_init(&p->closed,0);
+    atomic_init(&p->cancelled,0);
+    p->is_fatal = NULL;
+    p->on_drop = NULL;
+    p->fatal.code = 0;
+}
+
+/**
+* @brief Appends a stage to the pipeline. Must be called before tce_pipeline_start.
+* @param workers The number of worker threads for this stage.
+* @param on_error The stage's error sink, or NULL to drop failed items silently.
+* @return The index of the stage, or -1 if there are too many stages.
+*/
+static inline int tce_pipeline_add_stage(tce_pipeline* p,void* (*fn)(void*,void*),void* ctx,int workers,
+                                         void (*on_error)(void*,const tce_captured*,void*)){
+    tce_stage* st;
+    if (p->nstages >= TCE_PIPELINE_MAX_STAGES) return -1;
+    st = &p->stages[p->nstages];
+    st->fn = fn;
+    st->ctx = ctx;
+    st->on_error = on_error;
+    st->workers = workers < 1 ? 1 : workers > TCE_STAGE_MAX_WORKERS ? TCE_STAGE_MAX_WORKERS : workers;
+    st->index = p->nstages;
+    st->pipeline = p;
+    atomic_init(&st->live,0);
+    tce_ring_init(&st->in,p->capacity);
+    return p->nstages++;
+}
+
+// Selects the codes that cancel the whole pipeline instead of being routed to an error sink.
+static inline void tce_pipeline_set_fatal(tce_pipeline* p,int (*is_fatal)(int code)){
+    p->is_fatal = is_fatal;
+}
+
+// Sets the handler receiving the items still queued when the pipeline is cancelled.
+static inline void tce_pipeline_set_drop(tce_pipeline* p,void (*on_drop)(void* item)){
+    p->on_drop = on_drop;
+}
+
+// Pushes an item into a ring, waiting while it's full. Returns 0 if the pipeline got cancelled.
+static inline int __tce_pipeline_put(tce_pipeline* p,tce_ring* r,void* item){
+    while (!tce_ring_push(r,item)){
+        if (atomic_load_explicit(&p->cancelled,memory_order_relaxed)){
+            if (p->on_drop) p->on_drop(item);
+            return 0;
+        }
+        thrd_yield();
+    }
+    return 1;
+}
+
+// Runs a batch under one armed Try. A failing item is diverted and the Try is re-armed for the rest.
+static inline void __tce_stage_run_batch(tce_stage* st,void** items,int n){
+    tce_pipeline* p = st->pipeline;
+    tce_captured error;
+    volatile int i = 0;
+    while (i < n){
+        Try {
+            for (; i < n; ++i) items[i] = st->fn(items[i],st->ctx);
+        } CatchCustom(tce_capture(&error,ErrorCode)) {
+            if (p->is_fatal && p->is_fatal(error.code)){
+                int expected = 0;
+                // The first fatal exception wins; it's read by tce_pipeline_join after the workers are joined.
+                if (atomic_compare_exchange_strong(&p->cancelled,&expected,1)) p->fatal = error;
+            }
+            if (st->on_error) st->on_error(items[i],&error,st->ctx);
+            items[i] = NULL;
+            ++i;
+        } End;
+    }
+}
+
+static inline int __tce_stage_worker(void* arg){
+    tce_stage* st = (tce_stage*)arg;
+    tce_pipeline* p = st->pipeline;
+    tce_ring* out = st->index + 1 < p->nstages ? &p->stages[st->index + 1].in : NULL;
+    void* items[TCE_PIPELINE_BATCH];
+    while (!atomic_load_explicit(&p->cancelled,memory_order_relaxed)){
+        int n = 0;
+        // Read the upstream state before polling, so an empty ring really means drained.
+        int upstream_done = st->index == 0 ? atomic_load(&p->closed)
+                                           : atomic_load(&p->stages[st->index - 1].live) == 0;
+        while (n < TCE_PIPELINE_BATCH && tce_ring_pop(&st->in,&items[n])) ++n;
+        if (n == 0){
+            if (upstream_done) break;
+            thrd_yield();
+            continue;
+        }
+        __tce_stage_run_batch(st,items,n);
+        if (out){
+            for (int i = 0; i < n; ++i){
+                if (items[i] && !__tce_pipeline_put(p,out,items[i])){
+                    for (++i; i < n; ++i) if (items[i] && p->on_drop) p->on_drop(items[i]);
+                }
+            }
+        }
+    }
+    atomic_fetch_sub(&st->live,1);
+    return 0;
+}
+
+/**
+* @brief Starts the workers of every stage.
+* @return 1 on success, 0 if a thread could not be created (the pipeline is then cancelled).
+*/
+static inline int tce_pipeline_start(tce_pipeline* p){
+    for (int s = 0; s < p->nstages; ++s) atomic_store(&p->stages[s].live,p->stages[s].workers);
+    for (int s = 0; s < p->nstages; ++s){
+        tce_stage* st = &p->stages[s];
+        for (int w = 0; w < st->workers; ++w){
+            if (thrd_create(&st->threads[w],__tce_stage_worker,st) != thrd_success){
+                atomic_store(&p->cancelled,1);
+                atomic_fetch_sub(&st->live,st->workers - w);
+                st->workers = w;
+                // The later stages have no threads: tce_pipeline_join must not join them.
+                for (int rest = s + 1; rest < p->nstages; ++rest){
+                    p->stages[rest].workers = 0;
+                    atomic_store(&p->stages[rest].live,0);
+                }
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+/**
+* @brief Feeds an item to the first stage, waiting while its ring is full.
+* @return 1 if the item was accepted, 0 if the pipeline was cancelled (the item was dropped).
+*/
+static inline int tce_pipeline_push(tce_pipeline* p,void* item){
+    if (atomic_load_explicit(&p->cancelled,memory_order_relaxed)){
+        if (p->on_drop) p->on_drop(item);
+        return 0;
+    }
+    return __tce_pipeline_put(p,&p->stages[0].in,item);
+}
+
+// Declares the end of the input. Stages finish the queued items, then exit in order.
+static inline void tce_pipeline_close(tce_pipeline* p){
+    atomic_store(&p->closed,1);
+}
+
+/**
+* @brief Joins every stage in order and releases the rings.
+*        If a fatal exception cancelled the pipeline, it's re-thrown with its original site.
+*/
+static inline void tce_pipeline_join(tce_pipeline* p){
+    for (int s = 0; s < p->nstages; ++s){
+        tce_stage* st = &p->stages[s];
+        void* item;
+        for (int w = 0; w < st->workers; ++w) thrd_join(st->threads[w],NULL);
+        while (tce_ring_pop(&st->in,&item)) if (p->on_drop) p->on_drop(item);
+        tce_ring_destroy(&st->in);
+    }
+    p->nstages = 0;
+    if (atomic_load(&p->cancelled) && p->fatal.code) tce_rethrow(&p->fatal);
+}
+
+#endif // !__TINY_C_EXCEPTION_PIPELINE_H
\ No newline at end of file
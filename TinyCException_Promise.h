@@ -0,0 +1,396 @@
+#ifndef __TINY_C_EXCEPTION_PROMISE_H
+#define __TINY_C_EXCEPTION_PROMISE_H
+
+#include "TinyCException.h"
+#include <stdatomic.h>
+
+/*
+* TinyCException Promise - Promises with then/catch continuations on a pluggable executor.
+*
+* SYNTAX:
+*   tce_promise* head = tce_promise_new(tce_inline_executor());
+*   tce_promise* p = tce_then(head,parse);    // void* parse(void* value)
+*   p = tce_then(p,validate);
+*   p = tce_catch(p,ParseError,recover);      // void* recover(int code)
+*   tce_promise_resolve(head,input);          // The producer may settle 'head' before or after chaining.
+*   void* result = tce_promise_await(p);      // Re-throws if the chain was rejected.
+*
+* NOTES:
+*   - A continuation that throws rejects the downstream promise with the code and the throw site.
+*   - Continuations run in the request scope (tce_scope_set) of the thread that chained them.
+*   - A rejection skips 'tce_then' continuations until a matching 'tce_catch' handles it.
+*   - Every promise has exactly one owner. 'tce_then'/'tce_catch' consume their input promise and
+*     return the downstream one; 'tce_promise_await' consumes the last one.
+*     A promise can have at most one continuation.
+*   - Promise nodes come from a per-thread slab. Once a thread's slab is warm, building and running
+*     a chain does not call malloc. Nodes freed on another thread go back to their owner lock-free.
+*/
+
+#ifndef TCE_PROMISE_SLAB_CHUNK
+#define TCE_PROMISE_SLAB_CHUNK 64   // Promise nodes allocated at once when a slab runs dry.
+#endif
+
+#ifndef TCE_POOL_MAX_THREADS
+#define TCE_POOL_MAX_THREADS 64
+#endif
+
+// A unit of work scheduled on an executor. It's an intrusive node: submitting never allocates.
+typedef struct tce_task_t{
+    void (*run)(struct tce_task_t* self);
+    struct tce_task_t* next;
+} tce_task;
+
+// The executor interface. 'poll' is optional: if set, waiting threads use it to make progress.
+typedef struct tce_executor_t{
+    void (*submit)(struct tce_executor_t* self,tce_task* task);
+    int (*poll)(struct tce_executor_t* self);
+} tce_executor;
+
+// Runs every task immediately on the submitting thread.
+static inline void __tce_inline_submit(tce_executor* self,tce_task* task){
+    (void)self;
+    task->run(task);
+}
+
+// Returns the executor that runs continuations inline.
+static inline tce_executor* tce_inline_executor(void){
+    static tce_executor executor = {__tce_inline_submit,NULL};
+    return &executor;
+}
+
+// A FIFO executor. It works as an event loop (drained by tce_loop_run) or as a thread pool (tce_pool_start).
+typedef struct tce_queue_executor_t{
+    tce_executor base;
+    mtx_t lock;
+    cnd_t ready;
+    tce_task* head;
+    tce_task* tail;
+    int stopping;
+    int nthreads;
+    thrd_t threads[TCE_POOL_MAX_THREADS];
+} tce_queue_executor;
+
+static inline void __tce_queue_submit(tce_executor* self,tce_task* task){
+    tce_queue_executor* q = (tce_queue_executor*)self;
+    task->next = NULL;
+    mtx_lock(&q->lock);
+    if (q->tail) q->tail->next = task; else q->head = task;
+    q->tail = task;
+    cnd_signal(&q->ready);
+    mtx_unlock(&q->lock);
+}
+
+static inline tce_task* __tce_queue_pop(tce_queue_executor* q,int block){
+    tce_task* task;
+    mtx_lock(&q->lock);
+    while (block && !q->head && !q->stopping) cnd_wait(&q->ready,&q->lock);
+    task = q->head;
+    if (task){
+        q->head = task->next;
+        if (!q->head) q->tail = NULL;
+    }
+    mtx_unlock(&q->lock);
+    return task;
+}
+
+/**
+* @brief Runs the tasks currently queued on an event loop executor, including tasks they submit.
+* @return The number of tasks that were run.
+*/
+static inline int tce_loop_run(tce_queue_executor* q){
+    int count = 0;
+    tce_task* task;
+    while ((task = __tce_queue_pop(q,0))){
+        task->run(task);
+        ++count;
+    }
+    return count;
+}
+
+static inline int __tce_queue_poll(tce_executor* self){
+    tce_queue_executor* q = (tce_queue_executor*)self;
+    tce_task* task;
+    // A pool's workers drain the queue themselves; only a loop is pumped by the waiting thread.
+    if (q->nthreads) return 0;
+    task = __tce_queue_pop(q,0);
+    if (!task) return 0;
+    task->run(task);
+    return 1;
+}
+
+/**
+* @brief Initializes a FIFO executor. Use it as an event loop, or start a thread pool on it.
+*/
+static inline void tce_queue_executor_init(tce_queue_executor* q){
+    q->base.submit = __tce_queue_submit;
+    q->base.poll = __tce_queue_poll;
+    mtx_init(&q->lock,mtx_plain);
+    cnd_init(&q->ready);
+    q->head = q->tail = NULL;
+    q->stopping = 0;
+    q->nthreads = 0;
+}
+
+static inline int __tce_pool_worker(void* arg){
+    tce_queue_executor* q = (tce_queue_executor*)arg;
+    tce_task* task;
+    while ((task = __tce_queue_pop(q,1))) task->run(task);
+    return 0;
+}
+
+/**
+* @brief Starts 'nthreads' worker threads draining the executor's queue.
+* @return The number of workers actually started.
+*/
+static inline int tce_pool_start(tce_queue_executor* q,int nthreads){
+    if (nthreads > TCE_POOL_MAX_THREADS) nthreads = TCE_POOL_MAX_THREADS;
+    while (q->nthreads < nthreads){
+        if (thrd_create(&q->threads[q->nthreads],__tce_pool_worker,q) != thrd_success) break;
+        ++q->nthreads;
+    }
+    return q->nthreads;
+}
+
+/**
+* @brief Lets the workers finish the queued tasks, joins them and releases the executor.
+*/
+static inline void tce_pool_stop(tce_queue_executor* q){
+    mtx_lock(&q->lock);
+    q->stopping = 1;
+    cnd_broadcast(&q->ready);
+    mtx_unlock(&q->lock);
+    for (int i = 0; i < q->nthreads; ++i) thrd_join(q->threads[i],NULL);
+    q->nthreads = 0;
+    mtx_destroy(&q->lock);
+    cnd_destroy(&q->ready);
+}
+
+enum{
+    __TCE_PROMISE_PENDING = 0,  // Not settled, no continuation attached yet.
+    __TCE_PROMISE_CHAINED,      // Not settled, a continuation is waiting for it.
+    __TCE_PROMISE_SETTLED       // Fulfilled or rejected.
+};
+
+enum{
+    __TCE_CONT_NONE = 0,
+    __TCE_CONT_THEN,
+    __TCE_CONT_CATCH,
+    __TCE_CONT_CATCH_IF
+};
+
+struct tce_promise_slab_t;
+
+// A promise node. The continuation fields describe how this promise is produced from its upstream.
+typedef struct tce_promise_t{
+    tce_task task;                   // Scheduled on the executor once the upstream is settled.
+    atomic_int state;
+    void* value;                     // Result if fulfilled.
+    tce_captured error;              // Exception if rejected (error.code != 0).
+    int kind;                        // How this promise is derived from its upstream.
+    int catch_code;                  // For tce_catch: the code to handle, 0 for any.
+    union{
+        void* (*then_fn)(void*);
+        void* (*catch_fn)(int);
+    } fn;
+    int (*catch_pred)(int);          // For tce_catch_if.
+    struct tce_promise_t* next;      // The downstream promise.
+    tce_executor* executor;
+    tce_scope scope;                 // The request scope the continuation runs in.
+    struct tce_promise_slab_t* owner;
+    struct tce_promise_t* free_next;
+} tce_promise;
+
+// A per-thread free list of promise nodes.
+typedef struct tce_promise_slab_t{
+    tce_promise* local;              // Touched by the owner thread only.
+    _Atomic(tce_promise*) remote;    // Nodes released by other threads.
+} tce_promise_slab;
+
+thread_local static tce_promise_slab* __tce_promise_slab = NULL;
+
+static inline tce_promise* __tce_promise_alloc(void){
+    tce_promise_slab* slab = __tce_promise_slab;
+    tce_promise* p;
+    if (!slab){
+        slab = (tce_promise_slab*)malloc(sizeof(tce_promise_slab));
+        if (!slab) abort();
+        slab->local = NULL;
+        atomic_init(&slab->remote,NULL);
+        __tce_promise_slab = slab;
+    }
+    if (!slab->local) slab->local = atomic_exchange(&slab->remote,NULL);
+    if (!slab->local){
+        // Slab memory is never returned: nodes may still be in flight when their thread exits.
+        tce_promise* chunk = (tce_promise*)malloc(sizeof(tce_promise) * TCE_PROMISE_SLAB_CHUNK);
+        if (!chunk) abort();
+        for (int i = 0; i < TCE_PROMISE_SLAB_CHUNK; ++i){
+            chunk[i].owner = slab;
+            chunk[i].free_next = i + 1 < TCE_PROMISE_SLAB_CHUNK ? &chunk[i + 1] : NULL;
+        }
+        slab->local = chunk;
+    }
+    p = slab->local;
+    slab->local = p->free_next;
+    return p;
+}
+
+static inline void __tce_promise_free(tce_promise* p){
+    tce_promise_slab* slab = p->owner;
+    if (slab == __tce_promise_slab){
+        p->free_next = slab->local;
+        slab->local = p;
+    } else{
+        tce_promise* head = atomic_load(&slab->remote);
+        do{
+            p->free_next = head;
+        } while (!atomic_compare_exchange_weak(&slab->remote,&head,p));
+    }
+}
+
+static inline tce_promise* __tce_promise_init(tce_executor* executor,int kind){
+    tce_promise* p = __tce_promise_alloc();
+    atomic_init(&p->state,__TCE_PROMISE_PENDING);
+    p->value = NULL;
+    p->error.code = 0;
+    p->kind = kind;
+    p->next = NULL;
+    p->executor = executor;
+    p->scope = tce_scope_save();
+    return p;
+}
+
+static inline void __tce_promise_run(tce_task* task);
+
+// Publishes the result of 'p' and schedules its continuation if one is already attached.
+static inline void __tce_promise_settle(tce_promise* p){
+    if (atomic_exchange(&p->state,__TCE_PROMISE_SETTLED) == __TCE_PROMISE_CHAINED){
+        p->task.run = __tce_promise_run;
+        p->executor->submit(p->executor,&p->task);
+    }
+}
+
+// Runs the continuation of a settled promise, then releases it.
+static inline void __tce_promise_run(tce_task* task){
+    tce_promise* up = (tce_promise*)task;
+    tce_promise* p = up->next;
+    void* value = up->value;
+    tce_captured error = up->error;
+    tce_scope saved = tce_scope_save();
+    __tce_promise_free(up);
+    // Continuations run in the scope of the thread that chained them, whatever thread runs them.
+    tce_scope_restore(p->scope);
+    p->value = value;
+    p->error = error;
+    if (error.code == 0){
+        if (p->kind == __TCE_CONT_THEN){
+            Try {
+                p->value = p->fn.then_fn(value);
+            } CatchCustom(tce_capture(&p->error,ErrorCode)) {
+                p->value = NULL;
+            } End;
+        }
+    } else if ((p->kind == __TCE_CONT_CATCH && (p->catch_code == 0 || p->catch_code == error.code)) ||
+               (p->kind == __TCE_CONT_CATCH_IF && p->catch_pred(error.code))){
+        p->error.code = 0;
+        Try {
+            p->value = p->fn.catch_fn(error.code);
+        } CatchCustom(tce_capture(&p->error,ErrorCode)) {
+            p->value = NULL;
+        } End;
+    }
+    tce_scope_restore(saved);
+    __tce_promise_settle(p);
+}
+
+static inline tce_promise* __tce_promise_chain(tce_promise* up,tce_promise* p){
+    int expected = __TCE_PROMISE_PENDING;
+    up->next = p;
+    if (!atomic_compare_exchange_strong(&up->state,&expected,__TCE_PROMISE_CHAINED)){
+        // Already settled: run the continuation now.
+        up->task.run = __tce_promise_run;
+        up->executor->submit(up->executor,&up->task);
+    }
+    return p;
+}
+
+/**
+* @brief Creates a pending promise. Settle it with tce_promise_resolve or tce_promise_reject.
+* @param executor Where continuations derived from this promise run.
+*/
+static inline tce_promise* tce_promise_new(tce_executor* executor){
+    return __tce_promise_init(executor,__TCE_CONT_NONE);
+}
+
+/**
+* @brief Fulfills a pending promise. The promise must not be used by the caller afterwards.
+*/
+static inline void tce_promise_resolve(tce_promise* p,void* value){
+    p->value = value;
+    __tce_promise_settle(p);
+}
+
+/**
+* @brief Rejects a pending promise with an exception code, recording the caller's site.
+*/
+#define tce_promise_reject(p,code) \
+    __tce_promise_reject_at((p),(code),__FILE__,__FUNCTION__,__LINE__)
+
+static inline void __tce_promise_reject_at(tce_promise* p,int code,const char* file,const char* func,int line){
+    p->error.code = code;
+    p->error.file = file;
+    p->error.func = func;
+    p->error.line = line;
+    p->error.payload = NULL;
+    p->error.cause = 0;
+    __tce_promise_settle(p);
+}
+
+/**
+* @brief Attaches a continuation run with the fulfilled value. Consumes 'p'.
+* @return The downstream promise: fulfilled with fn's result, or rejected if fn throws.
+*/
+static inline tce_promise* tce_then(tce_promise* p,void* (*fn)(void*)){
+    tce_promise* next = __tce_promise_init(p->executor,__TCE_CONT_THEN);
+    next->fn.then_fn = fn;
+    return __tce_promise_chain(p,next);
+}
+
+/**
+* @brief Attaches a handler for a rejection with the given code (0 catches any code). Consumes 'p'.
+* @return The downstream promise: fulfilled with fn's result if handled, otherwise settled like 'p'.
+*/
+static inline tce_promise* tce_catch(tce_promise* p,int code,void* (*fn)(int)){
+    tce_promise* next = __tce_promise_init(p->executor,__TCE_CONT_CATCH);
+    next->catch_code = code;
+    next->fn.catch_fn = fn;
+    return __tce_promise_chain(p,next);
+}
+
+/**
+* @brief Like tce_catch, but handles every rejection for which 'pred(code)' is true.
+*/
+static inline tce_promise* tce_catch_if(tce_promise* p,int (*pred)(int),void* (*fn)(int)){
+    tce_promise* next = __tce_promise_init(p->executor,__TCE_CONT_CATCH_IF);
+    next->catch_pred = pred;
+    next->fn.catch_fn = fn;
+    return __tce_promise_chain(p,next);
+}
+
+/**
+* @brief Waits until 'p' is settled and consumes it. Pumps the executor if it can be polled.
+* @return The fulfilled value. If 'p' was rejected, re-throws its exception with the original site.
+*/
+static inline void* tce_promise_await(tce_promise* p){
+    tce_captured error;
+    void* value;
+    while (atomic_load(&p->state) != __TCE_PROMISE_SETTLED){
+        if (!p->executor->poll || !p->executor->poll(p->executor)) thrd_yield();
+    }
+    value = p->value;
+    error = p->error;
+    __tce_promise_free(p);
+    if (error.code) tce_rethrow(&error);
+    return value;
+}
+
+#endif // !__TINY_C_EXCEPTION_PROMISE_H
\ No newline at end of file
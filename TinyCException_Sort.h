@@ -0,0 +1,277 @@
+#ifndef __TINY_C_EXCEPTION_SORT_H
+#define __TINY_C_EXCEPTION_SORT_H
+
+#include "TinyCException.h"
+#include <stddef.h>
+
+/*
+* TinyCException Sort - A parallel merge sort and a binary search for comparators that Throw.
+*
+* SYNTAX:
+*   static int by_price(const void* a,const void* b){
+*       const row* x = a; const row* y = b;
+*       if (x->price < 0 || y->price < 0) Throw(BadRow);       // Validates while it sorts.
+*       return (x->price > y->price) - (x->price < y->price);
+*   }
+*
+*   Try {
+*       tce_sort(rows,n,sizeof(row),by_price);
+*       hit = tce_bsearch(&key,rows,n,sizeof(row),by_price);
+*   } Catch(BadRow) {
+*       // 'rows' holds the same rows as before, in some order.
+*   } End;
+*
+* NOTES:
+*   - Longjmp'ing out of a qsort comparator crosses libc frames and can leave elements lost or
+*     duplicated. tce_sort never moves an element while a comparison is pending: every step
+*     records what it has moved, and a throw undoes the step's half-done moves before it
+*     unwinds. After a throw, the array is a permutation of the input.
+*   - The sort is stable. Arrays of TCE_SORT_GRAIN elements or more are split among up to
+*     TCE_SORT_THREADS threads (the caller included), whose sorted chunks are merged pairwise.
+*   - If comparators throw on several threads, the first exception is re-thrown to the caller,
+*     with its original site, once every thread has stopped. The others are discarded.
+*   - It allocates a scratch buffer as large as the array, and aborts if it cannot.
+*/
+
+#ifndef TCE_SORT_THREADS
+#define TCE_SORT_THREADS 8          // Threads per sort, the caller included.
+#endif
+
+#ifndef TCE_SORT_GRAIN
+#define TCE_SORT_GRAIN 16384        // Elements per thread, at least.
+#endif
+
+#define __TCE_SORT_RUN 32           // Runs sorted by insertion before merging.
+
+enum{ __TCE_SORT_IDLE, __TCE_SORT_INSERT, __TCE_SORT_MERGE };
+
+struct __tce_sort_job_t;
+
+// A thread of a sort, and the step it's in, so a throw can undo it.
+typedef struct __tce_sort_worker_t{
+    struct __tce_sort_job_t* job;
+    int index;
+    int done;                       // Set when the worker has stopped, its range merged or not.
+    int step;
+    char* hole;                     // INSERT: the free slot, and the element taken out of it.
+    char* held;
+    char* lo;                       // MERGE: [lo,mid) was copied to 'left', and is merged with [mid,hi).
+    char* mid;
+    char* left;
+    char* next_left;                // The next elements of both halves.
+    char* next_right;
+    thrd_t thread;
+} __tce_sort_worker;
+
+typedef struct __tce_sort_job_t{
+    char* base;
+    size_t size;
+    int (*cmp)(const void*,const void*);
+    char* scratch;                  // As large as the array, plus one element per worker.
+    int nworkers;
+    size_t bounds[TCE_SORT_THREADS + 1];
+    mtx_t lock;
+    cnd_t merged;
+    atomic_int failed;
+    tce_captured error;             // The first exception.
+    __tce_sort_worker workers[TCE_SORT_THREADS];
+} __tce_sort_job;
+
+// Copies one element. The common sizes get fixed-size copies instead of a memcpy call.
+static inline void __tce_sort_copy(char* dst,const char* src,size_t size){
+    if (size == 4) memcpy(dst,src,4);
+    else if (size == 8) memcpy(dst,src,8);
+    else if (size == 16) memcpy(dst,src,16);
+    else memcpy(dst,src,size);
+}
+
+// Sorts [lo,hi) by insertion. The element being inserted is held aside until it's placed.
+static inline void __tce_sort_insert(__tce_sort_worker* w,char* lo,char* hi){
+    size_t size = w->job->size;
+    int (*cmp)(const void*,const void*) = w->job->cmp;
+    for (char* i = lo + size; i < hi; i += size){
+        char* j = i;
+        if (cmp(i - size,i) <= 0) continue;
+        __tce_sort_copy(w->held,i,size);
+        w->hole = j;
+        w->step = __TCE_SORT_INSERT;
+        do {
+            __tce_sort_copy(j,j - size,size);
+            j -= size;
+            w->hole = j;
+        } while (j > lo && cmp(j - size,w->held) > 0);
+        __tce_sort_copy(j,w->held,size);
+        w->step = __TCE_SORT_IDLE;
+    }
+}
+
+// Merges the sorted ranges [lo,mid) and [mid,hi). Only the left one is copied aside.
+static inline void __tce_sort_merge(__tce_sort_worker* w,char* lo,char* mid,char* hi){
+    size_t size = w->job->size;
+    int (*cmp)(const void*,const void*) = w->job->cmp;
+    char* left = w->job->scratch + (lo - w->job->base);
+    char* left_end = left + (mid - lo);
+    char* out = lo;
+    char* l = left;
+    char* r = mid;
+    if (cmp(mid - size,mid) <= 0) return;      // Already in order.
+    memcpy(left,lo,(size_t)(mid - lo));
+    w->lo = lo;
+    w->mid = mid;
+    w->left = left;
+    w->next_left = l;
+    w->next_right = r;
+    w->step = __TCE_SORT_MERGE;
+    while (l < left_end && r < hi){
+        if (cmp(r,l) < 0){
+            __tce_sort_copy(out,r,size);
+            r += size;
+            w->next_right = r;
+        } else{
+            __tce_sort_copy(out,l,size);
+            l += size;
+            w->next_left = l;
+        }
+        out += size;
+    }
+    memcpy(out,l,(size_t)(left_end - l));
+    w->step = __TCE_SORT_IDLE;
+}
+
+// Undoes the half-done step of a worker whose comparator threw.
+static inline void __tce_sort_repair(__tce_sort_worker* w){
+    size_t size = w->job->size;
+    if (w->step == __TCE_SORT_INSERT) __tce_sort_copy(w->hole,w->held,size);
+    else if (w->step == __TCE_SORT_MERGE){
+        // The output ends where the unmerged right half begins, minus the unmerged left elements.
+        size_t rest = (size_t)((w->mid - w->lo) - (w->next_left - w->left));
+        memcpy(w->next_right - rest,w->next_left,rest);
+    }
+    w->step = __TCE_SORT_IDLE;
+}
+
+// Sorts the chunk of a worker: runs by insertion, then bottom-up merges.
+static inline void __tce_sort_chunk(__tce_sort_worker* w){
+    __tce_sort_job* job = w->job;
+    size_t size = job->size;
+    char* lo = job->base + job->bounds[w->index] * size;
+    size_t len = (job->bounds[w->index + 1] - job->bounds[w->index]) * size;
+    size_t run = __TCE_SORT_RUN * size;
+    for (size_t p = 0; p < len; p += run) __tce_sort_insert(w,lo + p,lo + (len - p > run ? p + run : len));
+    for (size_t width = run; width < len; width *= 2){
+        if (atomic_load_explicit(&job->failed,memory_order_relaxed)) return;
+        for (size_t p = 0; p + width < len; p += 2 * width)
+            __tce_sort_merge(w,lo + p,lo + p + width,lo + (len - p - width > width ? p + 2 * width : len));
+    }
+}
+
+// Sorts the worker's chunk, then merges it with its partners' ranges, pairwise up the tree.
+// At each level, the worker waits for its partner to stop: the partner's range is then sorted.
+static inline void __tce_sort_work(__tce_sort_worker* w){
+    __tce_sort_job* job = w->job;
+    __tce_sort_chunk(w);
+    for (int level = 0; !(w->index >> level & 1); ++level){
+        int partner = w->index + (1 << level);
+        int end = w->index + (2 << level);
+        size_t size = job->size;
+        if (partner >= job->nworkers) break;
+        mtx_lock(&job->lock);
+        while (!job->workers[partner].done && !atomic_load(&job->failed)) cnd_wait(&job->merged,&job->lock);
+        mtx_unlock(&job->lock);
+        if (atomic_load(&job->failed)) return;
+        if (end > job->nworkers) end = job->nworkers;
+        __tce_sort_merge(w,job->base + job->bounds[w->index] * size,job->base + job->bounds[partner] * size,job->base + job->bounds[end] * size);
+    }
+}
+
+// Runs a worker. A throw is undone, recorded if it's the first, and stops the other workers.
+static inline void __tce_sort_run(__tce_sort_worker* w){
+    __tce_sort_job* job = w->job;
+    tce_captured error;
+    TryFn(w,__tce_sort_work)
+    CatchCustom(tce_capture(&error,ErrorCode)) {
+        __tce_sort_repair(w);
+        if (!atomic_exchange(&job->failed,1)) job->error = error;
+    } End;
+    // Done, or stopped: either way nobody has to wait for this worker any more.
+    mtx_lock(&job->lock);
+    w->done = 1;
+    cnd_broadcast(&job->merged);
+    mtx_unlock(&job->lock);
+}
+
+static inline int __tce_sort_thread(void* arg){
+    __tce_sort_run((__tce_sort_worker*)arg);
+    return 0;
+}
+
+/**
+* @brief Sorts an array like qsort, but 'cmp' may Throw. The sort is stable.
+*        If 'cmp' throws, the array is left a permutation of its input, and the first
+*        exception is re-thrown once every worker thread has stopped.
+*/
+static inline void tce_sort(void* base,size_t n,size_t size,int (*cmp)(const void*,const void*)){
+    __tce_sort_job* job;
+    int failed;
+    size_t nworkers = n / TCE_SORT_GRAIN;
+    if (n < 2 || !size) return;
+    if (nworkers > TCE_SORT_THREADS) nworkers = TCE_SORT_THREADS;
+    if (!nworkers) nworkers = 1;
+    if (n > ((size_t)-1 - sizeof(__tce_sort_job)) / size - nworkers) abort();
+    // Each worker's held element sits after the scratch copy of the array.
+    job = (__tce_sort_job*)malloc(sizeof(__tce_sort_job) + (n + nworkers) * size);
+    if (!job) abort();
+    job->base = (char*)base;
+    job->size = size;
+    job->cmp = cmp;
+    job->scratch = (char*)(job + 1);
+    job->nworkers = (int)nworkers;
+    atomic_init(&job->failed,0);
+    job->error.code = 0;
+    mtx_init(&job->lock,mtx_plain);
+    cnd_init(&job->merged);
+    for (int i = 0; i <= job->nworkers; ++i) job->bounds[i] = n * (size_t)i / nworkers;
+    for (int i = 0; i < job->nworkers; ++i){
+        __tce_sort_worker* w = &job->workers[i];
+        w->job = job;
+        w->index = i;
+        w->done = 0;
+        w->step = __TCE_SORT_IDLE;
+        w->held = job->scratch + (n + (size_t)i) * size;
+    }
+    for (int i = 1; i < job->nworkers; ++i)
+        if (thrd_create(&job->workers[i].thread,__tce_sort_thread,&job->workers[i]) != thrd_success) abort();
+    __tce_sort_run(&job->workers[0]);
+    for (int i = 1; i < job->nworkers; ++i) thrd_join(job->workers[i].thread,NULL);
+    failed = atomic_load(&job->failed);
+    if (failed){
+        tce_captured error = job->error;
+        mtx_destroy(&job->lock);
+        cnd_destroy(&job->merged);
+        free(job);
+        tce_rethrow(&error);
+    }
+    mtx_destroy(&job->lock);
+    cnd_destroy(&job->merged);
+    free(job);
+}
+
+/**
+* @brief Searches a sorted array like bsearch, but 'cmp' may Throw: no libc frame is crossed.
+* @return An element comparing equal to 'key', or NULL.
+*/
+static inline void* tce_bsearch(const void* key,const void* base,size_t n,size_t size,int (*cmp)(const void*,const void*)){
+    const char* lo = (const char*)base;
+    while (n){
+        const char* mid = lo + (n / 2) * size;
+        int c = cmp(key,mid);
+        if (!c) return (void*)mid;
+        if (c > 0){
+            lo = mid + size;
+            n -= n / 2 + 1;
+        } else n /= 2;
+    }
+    return NULL;
+}
+
+#endif // !__TINY_C_EXCEPTION_SORT_H
\ No newline at end of file
@@ -0,0 +1,192 @@
+#ifndef __TINY_C_EXCEPTION_VALIDATE_H
+#define __TINY_C_EXCEPTION_VALIDATE_H
+
+#include "TinyCException.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+* TinyCException Validate - Vectorized input checks that throw TCE_INVALID_INPUT at the first bad byte.
+*
+* SYNTAX:
+*   Try {
+*       tce_check_utf8(body,len);                        // Well-formed UTF-8.
+*       tce_check_digits(zip,5);                         // '0' to '9' only.
+*       tce_check_range(name,n,0x20,0x7E);               // Printable ASCII only.
+*       size_t eq = tce_check_delim(line,n,'=');         // The offset of the first '='.
+*   } Catch(TCE_INVALID_INPUT) {
+*       const tce_input_error* e = tce_input_last_error();
+*       fprintf(stderr,"bad %s at byte %zu\n",e->check,e->offset);
+*   } End;
+*
+* NOTES:
+*   - The scans run 32 bytes at a time with AVX2 or 16 with SSE2 or NEON, and byte by byte
+*     elsewhere. AVX2 is chosen at run time, on the first scan, if the CPU has it.
+*   - A block is only tested for "any bad byte"; the offset of the first one comes from the
+*     block's mask, so a failure costs nothing more than the block it's found in.
+*   - UTF-8 runs of ASCII are skipped by the vector scan. Non-ASCII characters are checked one by
+*     one (overlong forms, surrogates and code points over U+10FFFF are rejected), then the
+*     vector scan resumes.
+*   - The offset is the first byte that makes the input invalid: for a truncated UTF-8 sequence
+*     or a missing delimiter, it's the length of the input. It's also the payload of the
+*     exception (tce_current().payload).
+*/
+
+#if (defined(__GNUC__) || defined(__clang__)) && defined(__x86_64__)
+#define __TCE_SIMD_X86
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#define __TCE_SIMD_NEON
+#include <arm_neon.h>
+#endif
+
+// The details of the last TCE_INVALID_INPUT thrown on a thread.
+typedef struct tce_input_error_t{
+    size_t offset;                  // The first bad byte, from the start of the checked input.
+    const char* check;              // The name of the check, e.g. "utf8".
+} tce_input_error;
+
+thread_local static tce_input_error __tce_input_error;
+
+/**
+* @brief Returns the details of the last TCE_INVALID_INPUT thrown on this thread.
+*/
+static inline const tce_input_error* tce_input_last_error(void){
+    return &__tce_input_error;
+}
+
+static inline void __tce_input_fail(const char* check,size_t offset){
+    __tce_input_error.offset = offset;
+    __tce_input_error.check = check;
+    ThrowWith(TCE_INVALID_INPUT,&__tce_input_error);
+}
+
+// The offset of the first byte of [p,p+n) whose membership in [lo,lo+span] is 'inside', or n.
+static inline size_t __tce_scan_scalar(const uint8_t* p,size_t n,uint8_t lo,uint8_t span,int inside){
+    for (size_t i = 0; i < n; ++i)
+        if (((uint8_t)(p[i] - lo) <= span) == inside) return i;
+    return n;
+}
+
+#ifdef __TCE_SIMD_X86
+static inline size_t __tce_scan_sse2(const uint8_t* p,size_t n,uint8_t lo,uint8_t span,int inside){
+    const __m128i vlo = _mm_set1_epi8((char)lo);
+    const __m128i vspan = _mm_set1_epi8((char)span);
+    unsigned flip = inside ? 0 : 0xFFFF;
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16){
+        __m128i t = _mm_sub_epi8(_mm_loadu_si128((const __m128i*)(p + i)),vlo);
+        // Unsigned t <= span, as min(t,span) == t.
+        unsigned mask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_min_epu8(t,vspan),t)) ^ flip;
+        if (mask) return i + (size_t)__builtin_ctz(mask);
+    }
+    return i + __tce_scan_scalar(p + i,n - i,lo,span,inside);
+}
+
+__attribute__((target("avx2")))
+static inline size_t __tce_scan_avx2(const uint8_t* p,size_t n,uint8_t lo,uint8_t span,int inside){
+    const __m256i vlo = _mm256_set1_epi8((char)lo);
+    const __m256i vspan = _mm256_set1_epi8((char)span);
+    unsigned flip = inside ? 0 : 0xFFFFFFFFu;
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32){
+        __m256i t = _mm256_sub_epi8(_mm256_loadu_si256((const __m256i*)(p + i)),vlo);
+        unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_min_epu8(t,vspan),t)) ^ flip;
+        if (mask) return i + (size_t)__builtin_ctz(mask);
+    }
+    return i + __tce_scan_sse2(p + i,n - i,lo,span,inside);
+}
+
+static atomic_int __tce_simd_avx2 = -1;    // -1 until the CPU is checked.
+
+static inline size_t __tce_scan(const uint8_t* p,size_t n,uint8_t lo,uint8_t span,int inside){
+    int avx2 = atomic_load_explicit(&__tce_simd_avx2,memory_order_relaxed);
+    if (avx2 < 0){
+        __builtin_cpu_init();
+        avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+        atomic_store_explicit(&__tce_simd_avx2,avx2,memory_order_relaxed);
+    }
+    return avx2 ? __tce_scan_avx2(p,n,lo,span,inside) : __tce_scan_sse2(p,n,lo,span,inside);
+}
+#elif defined(__TCE_SIMD_NEON)
+static inline size_t __tce_scan(const uint8_t* p,size_t n,uint8_t lo,uint8_t span,int inside){
+    const uint8x16_t vlo = vdupq_n_u8(lo);
+    const uint8x16_t vspan = vdupq_n_u8(span);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16){
+        uint8x16_t hit = vcleq_u8(vsubq_u8(vld1q_u8(p + i),vlo),vspan);
+        uint64_t mask;
+        if (!inside) hit = vmvnq_u8(hit);
+        // Narrow each byte of the comparison to a nibble: a 64-bit mask, 4 bits per byte.
+        mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(hit),4)),0);
+        if (mask) return i + (size_t)(__builtin_ctzll(mask) >> 2);
+    }
+    return i + __tce_scan_scalar(p + i,n - i,lo,span,inside);
+}
+#else
+#define __tce_scan __tce_scan_scalar
+#endif
+
+/**
+* @brief Checks that every byte is in [lo,hi]. Throws TCE_INVALID_INPUT at the first one that's not.
+*/
+static inline void tce_check_range(const void* data,size_t n,unsigned char lo,unsigned char hi){
+    size_t bad = __tce_scan((const uint8_t*)data,n,lo,(uint8_t)(hi - lo),0);
+    if (bad < n) __tce_input_fail("range",bad);
+}
+
+/**
+* @brief Checks that every byte is a decimal digit. Throws TCE_INVALID_INPUT at the first one that's not.
+*/
+static inline void tce_check_digits(const void* data,size_t n){
+    size_t bad = __tce_scan((const uint8_t*)data,n,'0',9,0);
+    if (bad < n) __tce_input_fail("digits",bad);
+}
+
+/**
+* @brief Finds a required delimiter.
+* @return The offset of the first 'delim'. Throws TCE_INVALID_INPUT at offset n if there is none.
+*/
+static inline size_t tce_check_delim(const void* data,size_t n,unsigned char delim){
+    size_t at = __tce_scan((const uint8_t*)data,n,delim,0,1);
+    if (at == n) __tce_input_fail("delimiter",n);
+    return at;
+}
+
+// Checks the non-ASCII character at p[i]. Returns its length, or throws at its first bad byte.
+static inline size_t __tce_utf8_char(const uint8_t* p,size_t n,size_t i){
+    uint8_t c = p[i];
+    uint8_t min = 0x80, max = 0xBF;     // The range of the second byte.
+    size_t len;
+    if (c >= 0xC2 && c <= 0xDF) len = 2;
+    else if (c >= 0xE0 && c <= 0xEF){
+        len = 3;
+        if (c == 0xE0) min = 0xA0;      // Overlong.
+        else if (c == 0xED) max = 0x9F; // Surrogates.
+    } else if (c >= 0xF0 && c <= 0xF4){
+        len = 4;
+        if (c == 0xF0) min = 0x90;      // Overlong.
+        else if (c == 0xF4) max = 0x8F; // Over U+10FFFF.
+    } else __tce_input_fail("utf8",i);
+    for (size_t k = 1; k < len; ++k){
+        if (i + k == n) __tce_input_fail("utf8",n);
+        if (p[i + k] < min || p[i + k] > max) __tce_input_fail("utf8",i + k);
+        min = 0x80;
+        max = 0xBF;
+    }
+    return len;
+}
+
+/**
+* @brief Checks that the input is well-formed UTF-8. Throws TCE_INVALID_INPUT at the first bad byte.
+*/
+static inline void tce_check_utf8(const void* data,size_t n){
+    const uint8_t* p = (const uint8_t*)data;
+    size_t i = 0;
+    while ((i += __tce_scan(p + i,n - i,0,0x7F,0)) < n){
+        // Check the non-ASCII characters one by one, until the next ASCII byte.
+        do i += __tce_utf8_char(p,n,i); while (i < n && p[i] >= 0x80);
+    }
+}
+
+#endif // !__TINY_C_EXCEPTION_VALIDATE_H
\ No newline at end of file
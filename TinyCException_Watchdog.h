@@ -0,0 +1,192 @@
+#ifndef __TINY_C_EXCEPTION_WATCHDOG_H
+#define __TINY_C_EXCEPTION_WATCHDOG_H
+
+// Signals are POSIX, not C11. Include this header first when compiling with -std=c11.
+#if !defined(_POSIX_C_SOURCE) && !defined(_GNU_SOURCE) && !defined(_DEFAULT_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#ifndef TCE_WATCHDOG
+#define TCE_WATCHDOG
+#endif
+
+#include "TinyCException.h"
+#include <signal.h>
+#include <pthread.h>
+
+/*
+* TinyCException Watchdog - Reports Try blocks that run for too long, and can cancel them.
+*
+* SYNTAX:
+*   tce_watchdog_start(100,5000,TCE_WATCH_CANCEL,NULL,NULL);  // Scan every 100 ms, 5 s by default.
+*
+*   TryWatch(200) {                          // This site gets 200 ms.
+*       while (more(q)){
+*           tce_checkpoint();                // Throws TCE_CANCELLED once the watchdog cancels.
+*           step(q);
+*       }
+*   } Catch(TCE_CANCELLED) {
+*       give_up(q);
+*   } End;
+*
+*   tce_watchdog_stop();
+*
+* NOTES:
+*   - Every Try records when it was entered in the thread's frame array (TCE_WATCHDOG implies
+*     TCE_FRAME_ARRAY). The watchdog thread scans the arrays of every thread; it takes no lock,
+*     and the threads only publish their depth and timestamps with atomic stores.
+*   - A frame is overdue when it has run longer than its site's threshold: the one given to
+*     TryWatch, or the default given to tce_watchdog_start (0 watches TryWatch sites only).
+*     Each overdue frame is reported once, with the thread, the Try site and the time so far.
+*   - With TCE_WATCH_CANCEL, the thread of an overdue frame is also cancelled: its next
+*     tce_checkpoint() throws TCE_CANCELLED, once per overdue frame, if that frame is still
+*     running. A cancellation that no checkpoint takes ends with its frame.
+*   - With TCE_WATCH_INTERRUPT, the thread is also sent TCE_WATCHDOG_SIGNAL (SIGURG by default),
+*     whose handler does nothing but interrupt a blocked system call with EINTR. The wrappers of
+*     TinyCException_IO.h check for cancellation when they see EINTR. The signal is only sent
+*     if the frame is still running once it has been reported, and an exiting thread waits
+*     until the watchdog has finished signalling it, so its thread ID is never stale.
+*   - Include this header before any other TinyCException header, in every translation unit.
+*/
+
+#ifndef TCE_WATCHDOG_SIGNAL
+#define TCE_WATCHDOG_SIGNAL SIGURG
+#endif
+
+enum{
+    TCE_WATCH_REPORT = 0,           // Report overdue frames only.
+    TCE_WATCH_CANCEL = 1,           // Also cancel their threads.
+    TCE_WATCH_INTERRUPT = 2         // Also interrupt their blocked system calls.
+};
+
+// An overdue frame.
+typedef struct tce_overdue_t{
+    int thread;                     // The number of the thread's record, stable while it lives.
+    const char* file;               // The Try site.
+    const char* func;
+    int line;
+    int depth;                      // 1 for the outermost Try of the thread.
+    long long elapsed_ms;
+    int limit_ms;
+} tce_overdue;
+
+typedef void (*tce_overdue_fn)(const tce_overdue* frame,void* arg);
+
+static struct{
+    thrd_t thread;
+    atomic_int running;
+    unsigned period_ms;
+    unsigned default_ms;
+    int flags;
+    tce_overdue_fn report;
+    void* arg;
+} __tce_watchdog;
+
+// Sets the threshold of the innermost Try of the calling thread.
+static inline void __tce_watch_limit(unsigned ms){
+    if (__exp_depth <= TCE_MAX_FRAMES) atomic_store_explicit(&__exp_frames[__exp_depth - 1].limit_ms,(int)ms,memory_order_relaxed);
+}
+
+// A Try with its own threshold, in milliseconds.
+#define TryWatch(ms) Try __tce_watch_limit(ms);
+
+static inline void __tce_watch_print(const tce_overdue* f,void* arg){
+    (void)arg;
+    fprintf(stderr,"tce watchdog: thread #%d has been in the Try at %s:%d (%s, depth %d) for %lld ms, over %d ms\n",
+        f->thread,f->file,f->line,f->func,f->depth,f->elapsed_ms,f->limit_ms);
+}
+
+static inline void __tce_watch_interrupted(int signo){
+    (void)signo;
+}
+
+// Checks every frame of every thread once.
+static inline void __tce_watch_scan(void){
+    long long now = __tce_watch_now();
+    for (__tce_watch_thread* t = atomic_load(&__tce_watch_threads); t; t = t->next){
+        int depth;
+        if (!atomic_load_explicit(&t->alive,memory_order_acquire)) continue;
+        depth = atomic_load_explicit(&t->depth,memory_order_acquire);
+        if (depth > TCE_MAX_FRAMES) depth = TCE_MAX_FRAMES;
+        for (int i = 0; i < depth; ++i){
+            tce_frame_desc* d = &t->frames[i];
+            tce_overdue f;
+            long long entered = atomic_load_explicit(&d->entered,memory_order_acquire);
+            if (!entered) continue;
+            f.thread = t->id;
+            f.file = d->file;
+            f.func = d->func;
+            f.line = d->line;
+            f.limit_ms = atomic_load_explicit(&d->limit_ms,memory_order_relaxed);
+            atomic_thread_fence(memory_order_acquire);
+            // The frame was popped, or the descriptor reused, while it was read.
+            if (atomic_load_explicit(&d->entered,memory_order_relaxed) != entered) continue;
+            if (i >= atomic_load_explicit(&t->depth,memory_order_acquire)) break;
+            if (!f.limit_ms) f.limit_ms = (int)__tce_watchdog.default_ms;
+            f.elapsed_ms = (now - entered) / 1000000;
+            if (!f.limit_ms || f.elapsed_ms < f.limit_ms) continue;
+            if (atomic_exchange(&d->reported,entered) == entered) continue;
+            f.depth = i + 1;
+            __tce_watchdog.report(&f,__tce_watchdog.arg);
+            if (__tce_watchdog.flags & TCE_WATCH_CANCEL) atomic_store_explicit(&t->cancelled,entered,memory_order_release);
+            if (!(__tce_watchdog.flags & TCE_WATCH_INTERRUPT)) continue;
+            // The report may have taken a while: the thread may have left the frame, or exited.
+            // While 'signalling' is set, a thread that's still alive cannot finish exiting.
+            atomic_store(&t->signalling,1);
+            if (atomic_load(&t->alive) && i < atomic_load_explicit(&t->depth,memory_order_acquire) &&
+                atomic_load_explicit(&d->entered,memory_order_acquire) == entered)
+                pthread_kill((pthread_t)t->thread,TCE_WATCHDOG_SIGNAL);
+            atomic_store(&t->signalling,0);
+        }
+    }
+}
+
+static inline int __tce_watch_main(void* arg){
+    struct timespec period;
+    (void)arg;
+    period.tv_sec = (time_t)(__tce_watchdog.period_ms / 1000);
+    period.tv_nsec = (long)(__tce_watchdog.period_ms % 1000) * 1000000L;
+    while (atomic_load(&__tce_watchdog.running)){
+        thrd_sleep(&period,NULL);
+        __tce_watch_scan();
+    }
+    return 0;
+}
+
+/**
+* @brief Starts the watchdog thread.
+* @param period_ms How often the frames are scanned.
+* @param default_ms The threshold of sites without their own, or 0 to watch TryWatch sites only.
+* @param flags TCE_WATCH_REPORT, or TCE_WATCH_CANCEL and/or TCE_WATCH_INTERRUPT.
+* @param report Receives every overdue frame, on the watchdog thread. NULL prints to stderr.
+* @return 1 on success, 0 if it's already running or the thread cannot be created.
+*/
+static inline int tce_watchdog_start(unsigned period_ms,unsigned default_ms,int flags,tce_overdue_fn report,void* arg){
+    if (atomic_exchange(&__tce_watchdog.running,1)) return 0;
+    __tce_watchdog.period_ms = period_ms ? period_ms : 1;
+    __tce_watchdog.default_ms = default_ms;
+    __tce_watchdog.flags = flags;
+    __tce_watchdog.report = report ? report : __tce_watch_print;
+    __tce_watchdog.arg = arg;
+    if (flags & TCE_WATCH_INTERRUPT){
+        // No SA_RESTART: a blocked call returns EINTR instead of resuming.
+        struct sigaction sa;
+        memset(&sa,0,sizeof(sa));
+        sa.sa_handler = __tce_watch_interrupted;
+        sigemptyset(&sa.sa_mask);
+        sigaction(TCE_WATCHDOG_SIGNAL,&sa,NULL);
+    }
+    if (thrd_create(&__tce_watchdog.thread,__tce_watch_main,NULL) != thrd_success){
+        atomic_store(&__tce_watchdog.running,0);
+        return 0;
+    }
+    return 1;
+}
+
+// Stops the watchdog thread and waits for it.
+static inline void tce_watchdog_stop(void){
+    if (!atomic_exchange(&__tce_watchdog.running,0)) return;
+    thrd_join(__tce_watchdog.thread,NULL);
+}
+
+#endif // !__TINY_C_EXCEPTION_WATCHDOG_H
\ No newline at end of file
@@ -0,0 +1,261 @@
+/*
+* tce_armorder - Turns a TinyCException arm profile into a reordering report or a dispatch table.
+*
+* BUILD:
+*   cc -std=c11 -O2 -o tce_armorder tools/tce_armorder.c
+*
+* USAGE:
+*   cc -DTCE_PROFILE_ARMS app.c -o app && ./app       # Writes tce_arms.prof at exit
+*   tce_armorder tce_arms.prof                        # Report to stdout
+*   tce_armorder -t tce_arms.prof arms_gen.h          # TCE_CATCH_TABLE initializers
+*
+* REPORT:
+*   For every Try site, the arms in source order with their share of the exceptions, the mean
+*   number of arms tested per exception now and in the suggested order, and the suggested order.
+*   Only runs of consecutive Catch(code) arms are reordered: their codes are distinct, so their
+*   order does not change which arm handles an exception. CatchCustom, CatchTable and CatchAll
+*   stay where they are. Sites that would save the most tests come first.
+*
+* TABLE:
+*   One '#define TCE_ARMS_<file>_<line> TCE_CATCH_TABLE(...)' per site, listing the codes of its
+*   Catch(code) arms hottest first (at most TCE_CATCH_TABLE_MAX), to seed a CatchTable:
+*     static tce_catch_table arms = TCE_ARMS_app_c_42;
+*/
+
+#include <string.h>
+#include <ctype.h>
+
+#define TCE_ERRORS(X) \
+    X(ArmsSyntax, 1, "syntax error") \
+    X(ArmsLimit,  2, "limit exceeded") \
+    X(ArmsIO,     3, "cannot access file")
+#include "../TinyCException.h"
+
+#define MAX_SITES 4096
+#define MAX_ARMS 64
+#define MAX_TEXT 256
+
+typedef struct{
+    char label[MAX_TEXT];
+    int index;
+    int line;
+    unsigned long long tests;
+    unsigned long long hits;
+} arm_entry;
+
+typedef struct{
+    char file[MAX_TEXT];
+    char func[MAX_TEXT];
+    int line;
+    unsigned long long dispatches;
+    int narms;
+    arm_entry arms[MAX_ARMS];
+    int order[MAX_ARMS];            // The suggested order, as indexes into 'arms'.
+    double now;                     // Mean arms tested per exception, in source order.
+    double best;                    // The same, in the suggested order.
+} arm_site;
+
+static arm_site sites[MAX_SITES];
+static int nsites;
+
+static int current_line;
+static char detail[512];   // Context for the error being reported.
+
+#define Fail(e,...) \
+    do { \
+        snprintf(detail,sizeof(detail),__VA_ARGS__); \
+        Throw(e); \
+    } while(0)
+
+// Splits a line at tabs. Returns the number of fields.
+static int split(char* s,char** fields,int max){
+    int n = 0;
+    s[strcspn(s,"\r\n")] = 0;
+    while (n < max){
+        fields[n++] = s;
+        s = strchr(s,'\t');
+        if (!s) break;
+        *s++ = 0;
+    }
+    return n;
+}
+
+static unsigned long long parse_count(const char* s){
+    char* end;
+    unsigned long long v = strtoull(s,&end,10);
+    if (end == s || *end) Fail(ArmsSyntax,"'%s' is not a number",s);
+    return v;
+}
+
+static void copy_text(char* dst,const char* src){
+    if (strlen(src) >= MAX_TEXT) Fail(ArmsLimit,"'%.32s...' is too long",src);
+    strcpy(dst,src);
+}
+
+static void parse_profile(FILE* in){
+    char buf[1024];
+    arm_site* site = NULL;
+    while (fgets(buf,sizeof(buf),in)){
+        char* fields[6];
+        int n;
+        ++current_line;
+        if (buf[0] == '#' || buf[strspn(buf," \t\r\n")] == 0) continue;
+        n = split(buf,fields,6);
+        if (!strcmp(fields[0],"site") && n == 5){
+            if (nsites == MAX_SITES) Fail(ArmsLimit,"more than %d sites",MAX_SITES);
+            site = &sites[nsites++];
+            copy_text(site->file,fields[1]);
+            site->line = (int)parse_count(fields[2]);
+            copy_text(site->func,fields[3]);
+            site->dispatches = parse_count(fields[4]);
+        } else if (!strcmp(fields[0],"arm") && n == 6){
+            arm_entry* arm;
+            if (!site) Fail(ArmsSyntax,"arm before any site");
+            if (site->narms == MAX_ARMS) Fail(ArmsLimit,"more than %d arms",MAX_ARMS);
+            arm = &site->arms[site->narms++];
+            arm->index = (int)parse_count(fields[1]);
+            arm->line = (int)parse_count(fields[2]);
+            arm->tests = parse_count(fields[3]);
+            arm->hits = parse_count(fields[4]);
+            copy_text(arm->label,fields[5]);
+        } else Fail(ArmsSyntax,"expected a 'site' or 'arm' record");
+    }
+}
+
+// A Catch(code) arm can move within its run of Catch(code) arms.
+static int movable(const arm_entry* arm){
+    return !strncmp(arm->label,"Catch(",6);
+}
+
+// Sorts each run of movable arms by hits, and computes the mean tests in both orders.
+static void plan(arm_site* site){
+    unsigned long long tests = 0, best = 0, hits = 0;
+    for (int i = 0; i < site->narms; ++i) site->order[i] = i;
+    for (int start = 0; start < site->narms; ++start){
+        int end = start;
+        if (!movable(&site->arms[start])) continue;
+        while (end + 1 < site->narms && movable(&site->arms[end + 1])) ++end;
+        for (int i = start + 1; i <= end; ++i){
+            int a = site->order[i];
+            int j = i;
+            for (; j > start && site->arms[site->order[j - 1]].hits < site->arms[a].hits; --j) site->order[j] = site->order[j - 1];
+            site->order[j] = a;
+        }
+        start = end;
+    }
+    // An exception is tested by every arm up to the one that handles it, or by all of them.
+    for (int i = 0; i < site->narms; ++i){
+        tests += site->arms[i].tests;
+        hits += site->arms[i].hits;
+        best += site->arms[site->order[i]].hits * (unsigned long long)(i + 1);
+    }
+    best += (site->dispatches > hits ? site->dispatches - hits : 0) * (unsigned long long)site->narms;
+    site->now = site->dispatches ? (double)tests / (double)site->dispatches : 0;
+    site->best = site->dispatches ? (double)best / (double)site->dispatches : 0;
+}
+
+static int by_saving(const void* a,const void* b){
+    const arm_site* x = (const arm_site*)a;
+    const arm_site* y = (const arm_site*)b;
+    double sx = (x->now - x->best) * (double)x->dispatches;
+    double sy = (y->now - y->best) * (double)y->dispatches;
+    return (sx < sy) - (sx > sy);
+}
+
+static void report(FILE* out){
+    for (int s = 0; s < nsites; ++s){
+        arm_site* site = &sites[s];
+        int moved = 0;
+        fprintf(out,"%s:%d (%s): %llu exceptions, %.2f arms tested each, %.2f in the suggested order\n",
+            site->file,site->line,site->func,site->dispatches,site->now,site->best);
+        for (int i = 0; i < site->narms; ++i){
+            const arm_entry* arm = &site->arms[i];
+            fprintf(out,"  #%-2d line %-5d %6.1f%%  %s\n",arm->index,arm->line,
+                site->dispatches ? 100.0 * (double)arm->hits / (double)site->dispatches : 0.0,arm->label);
+            if (site->order[i] != i) moved = 1;
+        }
+        if (moved){
+            fprintf(out,"  suggested order:");
+            for (int i = 0; i < site->narms; ++i) fprintf(out,"%s %s",i ? "," : "",site->arms[site->order[i]].label);
+            fprintf(out,"\n");
+        } else fprintf(out,"  already in the best order\n");
+    }
+}
+
+// Writes the code of a Catch(code) label.
+static void emit_code(FILE* out,const char* label){
+    size_t n = strlen(label);
+    fprintf(out,"%.*s",(int)(n - 7),label + 6);
+}
+
+static void emit_table(FILE* out,const char* profile){
+    fprintf(out,"// Generated by tce_armorder from %s. Do not edit.\n",profile);
+    fprintf(out,"// Each table lists the Catch(code) arms of a Try site, hottest first.\n\n");
+    for (int s = 0; s < nsites; ++s){
+        arm_site* site = &sites[s];
+        const char* base = strrchr(site->file,'/');
+        int hot[MAX_ARMS];
+        int ncodes = 0, twin = 0;
+        for (int i = 0; i < site->narms; ++i){
+            int j = ncodes++;
+            if (!movable(&site->arms[i])){
+                --ncodes;
+                continue;
+            }
+            for (; j > 0 && site->arms[hot[j - 1]].hits < site->arms[i].hits; --j) hot[j] = hot[j - 1];
+            hot[j] = i;
+        }
+        if (!ncodes) continue;      // Nothing a table could hold.
+        if (ncodes > TCE_CATCH_TABLE_MAX) ncodes = TCE_CATCH_TABLE_MAX;
+        // Try blocks sharing a line get numbered names.
+        for (int o = 0; o < s; ++o) twin += sites[o].line == site->line && !strcmp(sites[o].file,site->file);
+        base = base ? base + 1 : site->file;
+        fprintf(out,"// %s:%d (%s): %llu exceptions\n#define TCE_ARMS_",site->file,site->line,site->func,site->dispatches);
+        for (const char* c = base; *c; ++c) fputc(isalnum((unsigned char)*c) ? *c : '_',out);
+        fprintf(out,"_%d",site->line);
+        if (twin) fprintf(out,"_%d",twin + 1);
+        fprintf(out," TCE_CATCH_TABLE(");
+        for (int i = 0; i < ncodes; ++i){
+            if (i) fprintf(out,",");
+            emit_code(out,site->arms[hot[i]].label);
+        }
+        fprintf(out,")\n\n");
+    }
+}
+
+int main(int argc,char** argv){
+    tce_captured error;
+    volatile int status = 0;
+    FILE* volatile in = NULL;
+    FILE* volatile out = NULL;
+    int table = argc > 1 && !strcmp(argv[1],"-t");
+    if (argc != (table ? 4 : 2)){
+        fprintf(stderr,"usage: %s <profile>\n       %s -t <profile> <output.h>\n",argv[0],argv[0]);
+        return 2;
+    }
+    Try {
+        const char* profile = argv[table ? 2 : 1];
+        if (!(in = fopen(profile,"r"))) Fail(ArmsIO,"%s",profile);
+        parse_profile(in);
+        current_line = 0;
+        for (int s = 0; s < nsites; ++s) plan(&sites[s]);
+        qsort(sites,(size_t)nsites,sizeof(arm_site),by_saving);
+        if (!table) report(stdout);
+        else{
+            if (!(out = fopen(argv[3],"w"))) Fail(ArmsIO,"%s",argv[3]);
+            emit_table(out,profile);
+        }
+    } CatchCustom(tce_capture(&error,ErrorCode)) {
+        const char* profile = argv[table ? 2 : 1];
+        if (current_line) fprintf(stderr,"%s:%d: error: %s: %s\n",profile,current_line,tce_strerror(error.code),detail);
+        else fprintf(stderr,"%s: error: %s: %s\n",profile,tce_strerror(error.code),detail);
+        status = 1;
+    } Finally {
+        if (in) fclose(in);
+        if (out){
+            fclose(out);
+            if (status) remove(argv[3]);
+        }
+    } End;
+    return status;
+}
\ No newline at end of file
@@ -0,0 +1,507 @@
+/*
+* tce_errgen - Generates an error catalog header for TinyCException from a declarative spec.
+*
+* BUILD:
+*   cc -std=c11 -O2 -o tce_errgen tools/tce_errgen.c
+*
+* USAGE:
+*   tce_errgen errors.spec errors_gen.h
+*
+* SPEC:
+*   # Comments start with '#' or ';'.
+*   [domain net]
+*   id = 2                         ; Domain number, packed in the high bits of every code.
+*
+*   [error NetError]               ; An error can be the parent of other errors.
+*   domain = net
+*   code = 0                       ; Code within the domain (0..65535).
+*   message = "network error"
+*
+*   [error Timeout]
+*   domain = net
+*   code = 1
+*   parent = NetError
+*   message = "connection timed out"
+*   action = log                   ; none | log | sample | count | abort
+*
+* OUTPUT:
+*   - The packed code of each error, as a TCE_ERRORS(X) list for the TinyCException catalog.
+*   - A static const entry table with domain, default action and hierarchy interval.
+*   - Perfect hash tables (hash and displace): code -> entry (tce_spec_lookup) and
+*     name -> entry (tce_spec_find).
+*   - TCE_IS_A(code,Kind) and CatchKind(Kind), which test the hierarchy in O(1)
+*     with the interval numbers of a pre-order walk.
+*   The generated header defines TCE_ERRORS, then includes "TinyCException.h": include it
+*   instead of TinyCException.h.
+*/
+
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+
+#define TCE_ERRORS(X) \
+    X(SpecSyntax,        1, "syntax error") \
+    X(SpecUnknownKey,    2, "unknown key") \
+    X(SpecUnknownDomain, 3, "unknown domain") \
+    X(SpecUnknownParent, 4, "unknown parent") \
+    X(SpecDuplicate,     5, "duplicate definition") \
+    X(SpecCycle,         6, "cyclic hierarchy") \
+    X(SpecLimit,         7, "limit exceeded") \
+    X(SpecIO,            8, "cannot access file") \
+    X(SpecHash,          9, "no perfect hash found")
+#include "../TinyCException.h"
+
+#define MAX_DOMAINS 256
+#define MAX_ERRORS 8192
+#define MAX_NAME 64
+#define MAX_MESSAGE 256
+#define DOMAIN_SHIFT 16
+
+typedef struct{
+    char name[MAX_NAME];
+    int id;
+} spec_domain;
+
+typedef struct{
+    char name[MAX_NAME];
+    char domain[MAX_NAME];
+    char parent[MAX_NAME];
+    char message[MAX_MESSAGE];
+    int code;
+    int action;
+    int line;
+    // Resolved after parsing.
+    int domain_id;
+    long value;
+    int parent_index;
+    int lo;
+    int hi;
+} spec_error;
+
+static spec_domain domains[MAX_DOMAINS];
+static int ndomains;
+static spec_error errors[MAX_ERRORS];
+static int nerrors;
+
+static int current_line;
+static char detail[512];   // Context for the error being reported.
+
+static const char* const action_names[] = {"none","log","sample","count","abort"};
+static const char* const action_enums[] = {"TCE_ACTION_NONE","TCE_ACTION_LOG","TCE_ACTION_SAMPLE","TCE_ACTION_COUNT","TCE_ACTION_ABORT"};
+
+#define Fail(e,...) \
+    do { \
+        snprintf(detail,sizeof(detail),__VA_ARGS__); \
+        Throw(e); \
+    } while(0)
+
+static char* trim(char* s){
+    char* end;
+    while (isspace((unsigned char)*s)) ++s;
+    end = s + strlen(s);
+    while (end > s && isspace((unsigned char)end[-1])) --end;
+    *end = 0;
+    return s;
+}
+
+static void copy_name(char* dst,const char* src){
+    size_t n = strlen(src);
+    if (n == 0 || n >= MAX_NAME) Fail(SpecSyntax,"invalid name '%s'",src);
+    if (!isalpha((unsigned char)src[0]) && src[0] != '_') Fail(SpecSyntax,"'%s' is not a C identifier",src);
+    for (size_t i = 0; i < n; ++i)
+        if (!isalnum((unsigned char)src[i]) && src[i] != '_') Fail(SpecSyntax,"'%s' is not a C identifier",src);
+    memcpy(dst,src,n + 1);
+}
+
+static long parse_number(const char* s){
+    char* end;
+    long v = strtol(s,&end,0);
+    if (end == s || *trim(end)) Fail(SpecSyntax,"'%s' is not a number",s);
+    return v;
+}
+
+// Parses a value that may be a double-quoted string with \" and \\ escapes.
+static void parse_string(char* dst,size_t cap,const char* s){
+    size_t n = 0;
+    if (*s != '"'){
+        if (strlen(s) >= cap) Fail(SpecLimit,"value too long");
+        strcpy(dst,s);
+        return;
+    }
+    for (++s; *s && *s != '"'; ++s){
+        if (*s == '\\' && s[1]) ++s;
+        if (n + 1 >= cap) Fail(SpecLimit,"value too long");
+        dst[n++] = *s;
+    }
+    if (*s != '"') Fail(SpecSyntax,"unterminated string");
+    dst[n] = 0;
+}
+
+// Removes a trailing comment, ignoring comment characters inside quotes.
+static void strip_comment(char* s){
+    int quoted = 0;
+    for (; *s; ++s){
+        if (*s == '\\' && quoted && s[1]) ++s;
+        else if (*s == '"') quoted = !quoted;
+        else if ((*s == '#' || *s == ';') && !quoted){
+            *s = 0;
+            return;
+        }
+    }
+}
+
+static void parse_spec(FILE* in){
+    char buf[1024];
+    spec_domain* dom = NULL;
+    spec_error* err = NULL;
+    while (fgets(buf,sizeof(buf),in)){
+        char* line;
+        char* eq;
+        ++current_line;
+        strip_comment(buf);
+        line = trim(buf);
+        if (!*line) continue;
+        if (*line == '['){
+            char* close = strchr(line,']');
+            char* kind;
+            char* name;
+            if (!close || *trim(close + 1)) Fail(SpecSyntax,"malformed section header");
+            *close = 0;
+            kind = trim(line + 1);
+            name = kind;
+            while (*name && !isspace((unsigned char)*name)) ++name;
+            if (*name) *name++ = 0;
+            name = trim(name);
+            dom = NULL;
+            err = NULL;
+            if (strcmp(kind,"domain") == 0){
+                if (ndomains == MAX_DOMAINS) Fail(SpecLimit,"more than %d domains",MAX_DOMAINS);
+                dom = &domains[ndomains++];
+                copy_name(dom->name,name);
+                dom->id = -1;
+            } else if (strcmp(kind,"error") == 0){
+                if (nerrors == MAX_ERRORS) Fail(SpecLimit,"more than %d errors",MAX_ERRORS);
+                err = &errors[nerrors++];
+                memset(err,0,sizeof(*err));
+                copy_name(err->name,name);
+                err->code = -1;
+                err->line = current_line;
+            } else{
+                Fail(SpecSyntax,"unknown section '%s'",kind);
+            }
+            continue;
+        }
+        eq = strchr(line,'=');
+        if (!eq) Fail(SpecSyntax,"expected 'key = value'");
+        *eq = 0;
+        {
+            char* key = trim(line);
+            char* value = trim(eq + 1);
+            if (dom){
+                if (strcmp(key,"id") == 0){
+                    long id = parse_number(value);
+                    if (id < 0 || id > 0x7FFF) Fail(SpecLimit,"domain id %ld out of range",id);
+                    dom->id = (int)id;
+                } else Fail(SpecUnknownKey,"'%s' in a domain",key);
+            } else if (err){
+                if (strcmp(key,"domain") == 0) copy_name(err->domain,value);
+                else if (strcmp(key,"parent") == 0) copy_name(err->parent,value);
+                else if (strcmp(key,"message") == 0) parse_string(err->message,MAX_MESSAGE,value);
+                else if (strcmp(key,"code") == 0){
+                    long code = parse_number(value);
+                    if (code < 0 || code > 0xFFFF) Fail(SpecLimit,"code %ld out of range",code);
+                    err->code = (int)code;
+                } else if (strcmp(key,"action") == 0){
+                    int a = 0;
+                    while (a < 5 && strcmp(value,action_names[a]) != 0) ++a;
+                    if (a == 5) Fail(SpecSyntax,"unknown action '%s'",value);
+                    err->action = a;
+                } else Fail(SpecUnknownKey,"'%s' in an error",key);
+            } else{
+                Fail(SpecSyntax,"key outside of a section");
+            }
+        }
+    }
+}
+
+static int find_error(const char* name){
+    for (int i = 0; i < nerrors; ++i) if (strcmp(errors[i].name,name) == 0) return i;
+    return -1;
+}
+
+// Numbers the hierarchy in pre-order: Kind's subtree is exactly the range [lo, hi] of its 'lo'.
+static int number_subtree(int index,int next,int depth){
+    if (depth > nerrors) Fail(SpecCycle,"around '%s'",errors[index].name);
+    errors[index].lo = next++;
+    for (int i = 0; i < nerrors; ++i)
+        if (errors[i].parent_index == index) next = number_subtree(i,next,depth + 1);
+    errors[index].hi = next - 1;
+    return next;
+}
+
+static void resolve(void){
+    int next = 0;
+    if (!nerrors) Fail(SpecSyntax,"the spec defines no error");
+    for (int d = 0; d < ndomains; ++d){
+        if (domains[d].id < 0) Fail(SpecSyntax,"domain '%s' has no id",domains[d].name);
+        for (int k = 0; k < d; ++k){
+            if (strcmp(domains[k].name,domains[d].name) == 0) Fail(SpecDuplicate,"domain '%s'",domains[d].name);
+            if (domains[k].id == domains[d].id) Fail(SpecDuplicate,"domain id %d",domains[d].id);
+        }
+    }
+    for (int i = 0; i < nerrors; ++i){
+        spec_error* e = &errors[i];
+        current_line = e->line;
+        if (e->code < 0) Fail(SpecSyntax,"error '%s' has no code",e->name);
+        e->domain_id = 0;
+        if (e->domain[0]){
+            int d = 0;
+            while (d < ndomains && strcmp(domains[d].name,e->domain) != 0) ++d;
+            if (d == ndomains) Fail(SpecUnknownDomain,"'%s'",e->domain);
+            e->domain_id = domains[d].id;
+        }
+        e->value = ((long)e->domain_id << DOMAIN_SHIFT) | e->code;
+        if (e->value == 0) Fail(SpecSyntax,"'%s' would have code 0",e->name);
+        e->parent_index = -1;
+        if (e->parent[0] && (e->parent_index = find_error(e->parent)) < 0) Fail(SpecUnknownParent,"'%s'",e->parent);
+        for (int k = 0; k < i; ++k){
+            if (strcmp(errors[k].name,e->name) == 0) Fail(SpecDuplicate,"error '%.63s'",e->name);
+            if (errors[k].value == e->value) Fail(SpecDuplicate,"'%.63s' and '%.63s' share code %ld",errors[k].name,e->name,e->value);
+        }
+    }
+    for (int i = 0; i < nerrors; ++i) errors[i].lo = -1;
+    for (int i = 0; i < nerrors; ++i)
+        if (errors[i].parent_index < 0) next = number_subtree(i,next,0);
+    for (int i = 0; i < nerrors; ++i){
+        current_line = errors[i].line;
+        if (errors[i].lo < 0) Fail(SpecCycle,"around '%s'",errors[i].name);
+    }
+}
+
+static uint32_t name_hash(const char* s){
+    uint32_t h = 2166136261u;
+    for (; *s; ++s){
+        h ^= (unsigned char)*s;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// The integer mixer used by the generated lookups (lowbias32).
+static uint32_t mix32(uint32_t x){
+    x ^= x >> 16;
+    x *= 0x7FEB352Du;
+    x ^= x >> 15;
+    x *= 0x846CA68Bu;
+    x ^= x >> 16;
+    return x;
+}
+
+// A hash-and-displace perfect hash: keys go to buckets by mix32(key), and every bucket gets
+// the seed that sends its keys to free slots: slot = mix32(key ^ seed[bucket]).
+typedef struct{
+    int bucket_bits;
+    int slot_bits;
+    uint32_t seeds[MAX_ERRORS];
+    int slots[MAX_ERRORS * 16];     // Key index + 1, 0 for an unused slot.
+} perfect_hash;
+
+static void build_perfect_hash(perfect_hash* ph,const uint32_t* keys,int n){
+    static int order[MAX_ERRORS];
+    static int bucket_of[MAX_ERRORS];
+    static int size_of[MAX_ERRORS];
+    static int taken[MAX_ERRORS * 16];
+    int bucket_bits = 0,slot_bits = 0;
+    while ((1 << bucket_bits) < (n + 1) / 2) ++bucket_bits;
+    while ((1 << slot_bits) < n) ++slot_bits;
+    ph->bucket_bits = bucket_bits;
+    for (int grow = 0; grow < 4; ++grow, ++slot_bits){
+        int nbuckets = 1 << bucket_bits,nslots = 1 << slot_bits,ok = 1;
+        for (int b = 0; b < nbuckets; ++b) size_of[b] = 0;
+        for (int i = 0; i < n; ++i) ++size_of[bucket_of[i] = (int)(mix32(keys[i]) & (uint32_t)(nbuckets - 1))];
+        // Place the largest buckets first, while the table is still empty.
+        for (int b = 0; b < nbuckets; ++b){
+            int j = b;
+            for (; j > 0 && size_of[order[j - 1]] < size_of[b]; --j) order[j] = order[j - 1];
+            order[j] = b;
+        }
+        for (int i = 0; i < nslots; ++i) ph->slots[i] = taken[i] = 0;
+        for (int k = 0; k < nbuckets && ok; ++k){
+            int b = order[k];
+            uint32_t seed;
+            ph->seeds[b] = 0;
+            if (!size_of[b]) continue;
+            for (seed = 0; seed < 0x10000; ++seed){
+                int fits = 1;
+                for (int i = 0; i < n && fits; ++i){
+                    if (bucket_of[i] != b) continue;
+                    uint32_t slot = mix32(keys[i] ^ seed) & (uint32_t)(nslots - 1);
+                    if (ph->slots[slot] || taken[slot] == (int)seed + 1) fits = 0;
+                    else taken[slot] = (int)seed + 1;   // Reserve it against keys of the same bucket.
+                }
+                if (fits) break;
+            }
+            if (seed == 0x10000){
+                ok = 0;
+                break;
+            }
+            ph->seeds[b] = seed;
+            for (int i = 0; i < n; ++i)
+                if (bucket_of[i] == b) ph->slots[mix32(keys[i] ^ seed) & (uint32_t)(nslots - 1)] = i + 1;
+        }
+        if (ok){
+            ph->slot_bits = slot_bits;
+            return;
+        }
+    }
+    Fail(SpecHash,"for %d keys",n);
+}
+
+static void emit_string(FILE* out,const char* s){
+    fputc('"',out);
+    for (; *s; ++s){
+        if (*s == '"' || *s == '\\') fputc('\\',out);
+        fputc(*s,out);
+    }
+    fputc('"',out);
+}
+
+static void emit_perfect_hash(FILE* out,const char* what,const char* prefix,const char* table,const perfect_hash* ph){
+    int nbuckets = 1 << ph->bucket_bits,nslots = 1 << ph->slot_bits;
+    fprintf(out,"// Perfect hash of the %s: slot = mix(key ^ seed[mix(key) & (buckets - 1)]) & (slots - 1).\n",what);
+    fprintf(out,"#define TCE_SPEC_%s_BUCKETS %d\n#define TCE_SPEC_%s_SLOTS %d\n",prefix,nbuckets,prefix,nslots);
+    fprintf(out,"static const uint16_t tce_spec_%s_seeds[%d] = {",table,nbuckets);
+    for (int i = 0; i < nbuckets; ++i) fprintf(out,"%s%u",i == 0 ? "\n    " : i % 16 ? "," : ",\n    ",ph->seeds[i]);
+    fprintf(out,"\n};\n// Entry index + 1, 0 for an unused slot.\n");
+    fprintf(out,"static const uint16_t tce_spec_%s_slots[%d] = {",table,nslots);
+    for (int i = 0; i < nslots; ++i) fprintf(out,"%s%d",i == 0 ? "\n    " : i % 16 ? "," : ",\n    ",ph->slots[i]);
+    fprintf(out,"\n};\n\n");
+}
+
+static void emit(FILE* out,const char* spec,const char* guard){
+    static uint32_t keys[MAX_ERRORS];
+    static perfect_hash ph;
+    int n = nerrors;
+    fprintf(out,"/* Generated by tce_errgen from %s. Do not edit. */\n",spec);
+    fprintf(out,"#ifndef %s\n#define %s\n\n#include <stdint.h>\n\n",guard,guard);
+    fprintf(out,"// Codes pack their domain in the high bits.\n");
+    fprintf(out,"#define TCE_DOMAIN_SHIFT %d\n",DOMAIN_SHIFT);
+    fprintf(out,"#define TCE_DOMAIN_OF(code) ((int)((unsigned)(code) >> TCE_DOMAIN_SHIFT))\n\n");
+    if (ndomains){
+        fprintf(out,"enum{\n");
+        for (int d = 0; d < ndomains; ++d) fprintf(out,"    TCE_DOMAIN_%s = %d,\n",domains[d].name,domains[d].id);
+        fprintf(out,"};\n\n");
+    }
+    fprintf(out,"// The catalog, in the TinyCException TCE_ERRORS(X) format.\n#define TCE_ERRORS(X)");
+    for (int i = 0; i < n; ++i){
+        fprintf(out," \\\n    X(%s,%ld,",errors[i].name,errors[i].value);
+        emit_string(out,errors[i].message[0] ? errors[i].message : errors[i].name);
+        fprintf(out,")");
+    }
+    fprintf(out,"\n\n#include \"TinyCException.h\"\n\n");
+    fprintf(out,"// Hierarchy intervals: an error is a kind of K iff its 'lo' is in [TCE_LO_K, TCE_HI_K].\nenum{\n");
+    for (int i = 0; i < n; ++i) fprintf(out,"    TCE_LO_%s = %d, TCE_HI_%s = %d,\n",errors[i].name,errors[i].lo,errors[i].name,errors[i].hi);
+    fprintf(out,"};\n\n");
+    fprintf(out,"typedef struct tce_spec_entry_t{\n    int code;\n    const char* name;\n    const char* message;\n"
+                "    int domain;\n    int lo;\n    int hi;\n    int action;      // The default TCE_ACTION_* of the code.\n} tce_spec_entry;\n\n");
+    fprintf(out,"#define TCE_SPEC_COUNT %d\n\n",n);
+    fprintf(out,"static const tce_spec_entry tce_spec_entries[%d] = {\n",n);
+    for (int i = 0; i < n; ++i){
+        fprintf(out,"    {%ld,\"%s\",",errors[i].value,errors[i].name);
+        emit_string(out,errors[i].message[0] ? errors[i].message : errors[i].name);
+        fprintf(out,",%d,%d,%d,%s},\n",errors[i].domain_id,errors[i].lo,errors[i].hi,action_enums[errors[i].action]);
+    }
+    fprintf(out,"};\n\n");
+    fprintf(out,
+        "// The integer mixer of the perfect hashes (lowbias32).\n"
+        "static inline uint32_t tce_spec_mix(uint32_t x){\n"
+        "    x ^= x >> 16;\n"
+        "    x *= 0x7FEB352Du;\n"
+        "    x ^= x >> 15;\n"
+        "    x *= 0x846CA68Bu;\n"
+        "    x ^= x >> 16;\n"
+        "    return x;\n"
+        "}\n\n");
+    for (int i = 0; i < n; ++i) keys[i] = (uint32_t)errors[i].value;
+    build_perfect_hash(&ph,keys,n);
+    emit_perfect_hash(out,"codes","CODE","code",&ph);
+    for (int i = 0; i < n; ++i) keys[i] = name_hash(errors[i].name);
+    build_perfect_hash(&ph,keys,n);
+    emit_perfect_hash(out,"names (FNV-1a)","NAME","name",&ph);
+    fprintf(out,
+        "static inline int __tce_spec_slot(const uint16_t* seeds,int buckets,const uint16_t* slots,int nslots,uint32_t key){\n"
+        "    uint32_t seed = seeds[tce_spec_mix(key) & (uint32_t)(buckets - 1)];\n"
+        "    return slots[tce_spec_mix(key ^ seed) & (uint32_t)(nslots - 1)];\n"
+        "}\n\n"
+        "// Returns the entry of a code, or NULL. Two table loads, no loop.\n"
+        "static inline const tce_spec_entry* tce_spec_lookup(int code){\n"
+        "    int i = __tce_spec_slot(tce_spec_code_seeds,TCE_SPEC_CODE_BUCKETS,tce_spec_code_slots,TCE_SPEC_CODE_SLOTS,(uint32_t)code);\n"
+        "    return i && tce_spec_entries[i - 1].code == code ? &tce_spec_entries[i - 1] : NULL;\n"
+        "}\n\n"
+        "// Returns the entry of an error name, or NULL.\n"
+        "static inline const tce_spec_entry* tce_spec_find(const char* name){\n"
+        "    uint32_t h = 2166136261u;\n"
+        "    const char* s = name;\n"
+        "    const char* n;\n"
+        "    int i;\n"
+        "    for (; *s; ++s){\n"
+        "        h ^= (unsigned char)*s;\n"
+        "        h *= 16777619u;\n"
+        "    }\n"
+        "    i = __tce_spec_slot(tce_spec_name_seeds,TCE_SPEC_NAME_BUCKETS,tce_spec_name_slots,TCE_SPEC_NAME_SLOTS,h);\n"
+        "    if (!i) return NULL;\n"
+        "    for (s = name, n = tce_spec_entries[i - 1].name; *s && *s == *n; ++s, ++n);\n"
+        "    return *s == *n ? &tce_spec_entries[i - 1] : NULL;\n"
+        "}\n\n"
+        "// Tests in O(1) whether a code is the error Kind or one of its descendants.\n"
+        "static inline int tce_spec_is_a(int code,int lo,int hi){\n"
+        "    const tce_spec_entry* e = tce_spec_lookup(code);\n"
+        "    return e && e->lo >= lo && e->lo <= hi;\n"
+        "}\n\n"
+        "#define TCE_IS_A(code,Kind) tce_spec_is_a((code),TCE_LO_##Kind,TCE_HI_##Kind)\n\n"
+        "// Catches Kind and every error below it in the hierarchy.\n"
+        "#define CatchKind(Kind) CatchCustom(TCE_IS_A(ErrorCode,Kind))\n\n");
+    fprintf(out,"#endif // !%s\n",guard);
+}
+
+// Derives an include guard from the output path: "gen/net_errors.h" -> "__NET_ERRORS_H".
+static void make_guard(char* guard,size_t cap,const char* path){
+    const char* base = strrchr(path,'/');
+    size_t n = 2;
+    base = base ? base + 1 : path;
+    strcpy(guard,"__");
+    for (; *base && n + 1 < cap; ++base) guard[n++] = isalnum((unsigned char)*base) ? (char)toupper((unsigned char)*base) : '_';
+    guard[n] = 0;
+}
+
+int main(int argc,char** argv){
+    tce_captured error;
+    volatile int status = 0;
+    FILE* volatile in = NULL;
+    FILE* volatile out = NULL;
+    if (argc != 3){
+        fprintf(stderr,"usage: %s <spec> <output.h>\n",argv[0]);
+        return 2;
+    }
+    Try {
+        char guard[128];
+        if (!(in = fopen(argv[1],"r"))) Fail(SpecIO,"%s",argv[1]);
+        parse_spec(in);
+        resolve();
+        current_line = 0;
+        if (!(out = fopen(argv[2],"w"))) Fail(SpecIO,"%s",argv[2]);
+        make_guard(guard,sizeof(guard),argv[2]);
+        emit(out,argv[1],guard);
+    } CatchCustom(tce_capture(&error,ErrorCode)) {
+        if (current_line) fprintf(stderr,"%s:%d: error: %s: %s\n",argv[1],current_line,tce_strerror(error.code),detail);
+        else fprintf(stderr,"%s: error: %s: %s\n",argv[1],tce_strerror(error.code),detail);
+        status = 1;
+    } Finally {
+        if (in) fclose(in);
+        if (out){
+            fclose(out);
+            if (status) remove(argv[2]);
+        }
+    } End;
+    return status;
+}
\ No newline at end of file